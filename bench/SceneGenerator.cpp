@@ -0,0 +1,171 @@
+#include "SceneGenerator.h"
+
+#include "Philox.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace {
+
+// splitmix64, used instead of the standard distributions whose output differs between libraries.
+class Random
+{
+public:
+    Random(std::uint64_t seed) :
+        state(seed) {}
+
+    std::uint64_t next()
+    {
+        return mix64(state += 0x9e3779b97f4a7c15ull);
+    }
+
+    // Uniform in [a, b).
+    double uniform(double a = 0, double b = 1)
+        {return a + (b - a) * ((next() >> 11) * (1.0 / 9007199254740992.0));}
+
+    // Standard normal, Box-Muller.
+    double normal()
+    {
+        double u = uniform();
+        double v = uniform();
+        return std::sqrt(-2 * std::log(1 - u)) * std::cos(2 * M_PI * v);
+    }
+
+    Vec3d direction()
+    {
+        Vec3d v(normal(), normal(), normal());
+        return v.normalized();
+    }
+
+private:
+    std::uint64_t state;
+};
+
+}
+
+void SceneGenerator::generate(const SceneParams& params, PointCloud& cloud, Scene& scene)
+{
+    Random random(params.seed);
+
+    struct Rectangle
+    {
+        Vec3d center;
+        Vec3d u;
+        Vec3d v;
+        double halfU;
+        double halfV;
+        RGB color;
+    };
+
+    std::vector<Rectangle> rects;
+    double totalArea = 0;
+    for (int i = 0 ; i < params.planes ; ++i)
+    {
+        Rectangle r;
+        Vec3d normal = random.direction();
+        r.center = Vec3d(random.uniform(-params.extent, params.extent), random.uniform(-params.extent, params.extent), random.uniform(-params.extent, params.extent));
+        Vec3d helper = std::abs(normal.x) < 0.9 ? Vec3d(1, 0, 0) : Vec3d(0, 1, 0);
+        r.u = (normal ^ helper).normalized();
+        r.v = normal ^ r.u;
+        r.halfU = random.uniform(params.minSize, params.maxSize) / 2;
+        r.halfV = random.uniform(params.minSize, params.maxSize) / 2;
+        r.color = RGB(random.next() & 255, random.next() & 255, random.next() & 255);
+        rects.push_back(r);
+        totalArea += r.halfU * r.halfV;
+
+        scene.normals.push_back(normal);
+        scene.offsets.push_back(-(normal * r.center));
+    }
+
+    // Points per plane, proportional to the area.
+    std::size_t outliers = rects.empty() ? params.points : std::size_t(params.points * params.outliers);
+    std::vector<std::size_t> counts;
+    std::size_t assigned = 0;
+    for (auto&& r : rects)
+    {
+        counts.push_back(std::size_t((params.points - outliers) * (r.halfU * r.halfV / totalArea)));
+        assigned += counts.back();
+    }
+    outliers = params.points - assigned;
+
+    cloud.reserve(cloud.size() + params.points);
+    scene.labels.reserve(scene.labels.size() + params.points);
+    for (unsigned int i = 0 ; i < rects.size() ; ++i)
+    {
+        const Rectangle& r = rects[i];
+        Vec3d normal = scene.normals[i];
+        for (std::size_t k = 0 ; k < counts[i] ; ++k)
+        {
+            Vec3d p = r.center + r.u * random.uniform(-r.halfU, r.halfU) + r.v * random.uniform(-r.halfV, r.halfV)
+                    + normal * (params.noise * random.normal());
+            cloud.addPoint(Point(p), r.color);
+            scene.labels.push_back(i);
+        }
+    }
+
+    double box = params.extent + params.maxSize / 2;
+    for (std::size_t k = 0 ; k < outliers ; ++k)
+    {
+        cloud.addPoint(Point(Vec3d(random.uniform(-box, box), random.uniform(-box, box), random.uniform(-box, box))), RGB(128, 128, 128));
+        scene.labels.push_back(-1);
+    }
+
+    cloud.boundingBox();
+}
+
+Quality SceneGenerator::evaluate(const Scene& scene, const std::vector<SharedPlane>& planes, const UnionFindPlanes& colors)
+{
+    Quality quality = {0, 0, 0, 0, 0};
+    const int numPlanes = scene.normals.size();
+
+    std::vector<std::size_t> truthSize(numPlanes);
+    for (int label : scene.labels)
+        if (label >= 0)
+            ++truthSize[label];
+
+    // Best detected plane of every ground truth plane.
+    std::vector<std::size_t> bestOverlap(numPlanes);
+    std::vector<double> bestAngle(numPlanes);
+
+    std::size_t members = 0;
+    std::size_t correct = 0;
+    for (auto&& plane : planes)
+    {
+        if (!plane || plane->getCount() == 0)
+            continue;
+        ++quality.detected;
+
+        std::vector<std::size_t> overlap(numPlanes);
+        for (PointIndex i : plane->members(colors))
+            if (i < scene.labels.size() && scene.labels[i] >= 0)
+                ++overlap[scene.labels[i]];
+
+        int majority = std::max_element(overlap.begin(), overlap.end()) - overlap.begin();
+        members += plane->getCount();
+        if (numPlanes == 0)
+            continue;
+        correct += overlap[majority];
+
+        if (overlap[majority] > bestOverlap[majority])
+        {
+            bestOverlap[majority] = overlap[majority];
+            double c = std::min(1.0, std::abs(plane->normal * scene.normals[majority]));
+            bestAngle[majority] = std::acos(c) * 180 / M_PI;
+        }
+    }
+
+    quality.precision = members ? double(correct) / members : 0;
+    for (int i = 0 ; i < numPlanes ; ++i)
+    {
+        if (bestOverlap[i] == 0)
+            continue;
+        ++quality.matched;
+        quality.recall += double(bestOverlap[i]) / truthSize[i];
+        quality.angleError += bestAngle[i];
+    }
+    if (numPlanes)
+        quality.recall /= numPlanes;
+    if (quality.matched)
+        quality.angleError /= quality.matched;
+    return quality;
+}
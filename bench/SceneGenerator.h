@@ -0,0 +1,59 @@
+#ifndef SCENE_GENERATOR_H
+#define SCENE_GENERATOR_H
+
+#include "Plane.h"
+#include "PointCloud.h"
+#include <cstdint>
+#include <vector>
+
+// Parameters of a synthetic scene made of noisy rectangles and outliers.
+struct SceneParams
+{
+    std::size_t points = 1000000;
+    int planes = 8;
+    // Range of the side lengths of the rectangles.
+    double minSize = 4;
+    double maxSize = 16;
+    // Centers of the rectangles are drawn in [-extent, extent]^3.
+    double extent = 10;
+    // Standard deviation of the noise along the normal.
+    double noise = 0.01;
+    // Fraction of points drawn uniformly in the scene box.
+    double outliers = 0.05;
+    std::uint64_t seed = 1;
+};
+
+// Ground truth of a generated scene.
+struct Scene
+{
+    std::vector<Vec3d> normals;
+    std::vector<double> offsets;
+    // Plane of every point, -1 for outliers.
+    std::vector<int> labels;
+};
+
+// Detection quality against the ground truth.
+struct Quality
+{
+    // Planes found, and ground truth planes matched by one of them.
+    int detected;
+    int matched;
+    // Fraction of the points of detected planes that belong to their majority ground truth plane.
+    double precision;
+    // Mean fraction of the points of a ground truth plane found by its best detected plane.
+    double recall;
+    // Mean angle in degrees between matched normals.
+    double angleError;
+};
+
+// Deterministic generator of synthetic scenes, identical on every platform for a given seed.
+class SceneGenerator
+{
+public:
+    static void generate(const SceneParams& params, PointCloud& cloud, Scene& scene);
+
+    // Compare detected planes, with their member points listed in colors, to the ground truth.
+    static Quality evaluate(const Scene& scene, const std::vector<SharedPlane>& planes, const UnionFindPlanes& colors);
+};
+
+#endif // SCENE_GENERATOR_H
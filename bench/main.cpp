@@ -0,0 +1,354 @@
+#include "SceneGenerator.h"
+#include "LinearOctree.h"
+#include "NormalEstimation.h"
+#include "Octree.h"
+#include "PlaneKernels.h"
+#include "Ply.h"
+#include "Ransac.h"
+#include "TaskScheduler.h"
+#include "VoxelGrid.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+// Allocation counters, updated by the replacement of the global operator new.
+static std::atomic<std::size_t> allocations(0);
+static std::atomic<std::size_t> allocatedBytes(0);
+
+void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// Command line options.
+struct Options
+{
+    SceneParams scene;
+    unsigned int threads = 0;
+    int repeat = 3;
+    // Only run the benchmarks whose name contains this string.
+    std::string filter;
+    unsigned int leafCapacity = 16;
+    // Points per block in the RANSAC and merge benchmarks.
+    unsigned int blockSize = 1000;
+    // Side of the voxels of the downsampling benchmark.
+    double voxelSize = 0.05;
+    // Neighbours of the normal estimation, and RANSAC hypotheses per plane of the benchmarks that use normals.
+    unsigned int normalNeighbors = 16;
+    int normalSteps = 4;
+    std::string tmp = "plane_detection_bench.ply";
+    DetectionParams params;
+};
+
+// Time and allocations of a benchmark.
+class Bench
+{
+public:
+    Bench(const Options& options) :
+        mOptions(options) {}
+
+    // Run f repeat times, each one after setup, and report the fastest run.
+    // items is the number of points, or other units, processed by one run.
+    bool run(const std::string& name, double items, const char* unit, const std::function<void()>& setup, const std::function<void()>& f)
+    {
+        if (name.find(mOptions.filter) == std::string::npos)
+            return false;
+
+        double best = -1;
+        std::size_t count = 0;
+        std::size_t bytes = 0;
+        for (int r = 0 ; r < std::max(1, mOptions.repeat) ; ++r)
+        {
+            setup();
+            std::size_t count0 = allocations.load();
+            std::size_t bytes0 = allocatedBytes.load();
+            auto start = std::chrono::steady_clock::now();
+            f();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            count = allocations.load() - count0;
+            bytes = allocatedBytes.load() - bytes0;
+            if (best < 0 || seconds < best)
+                best = seconds;
+        }
+
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setw(10) << std::setprecision(2) << best * 1000 << " ms"
+                  << std::setw(10) << std::setprecision(3) << items / best / 1e6 << " M" << unit << "/s"
+                  << std::setw(12) << count << " allocs"
+                  << std::setw(10) << std::setprecision(1) << bytes / 1048576.0 << " MB" << std::endl;
+        return true;
+    }
+
+private:
+    const Options& mOptions;
+};
+
+static void printQuality(const Quality& q, int planes)
+{
+    std::cout << std::setprecision(3)
+              << "    " << q.detected << " planes, " << q.matched << "/" << planes << " matched"
+              << ", precision " << q.precision << ", recall " << q.recall
+              << ", normal error " << q.angleError << " deg" << std::endl;
+}
+
+static void runBenchmarks(const Options& options)
+{
+    Bench bench(options);
+    TaskScheduler scheduler(options.threads);
+    const double n = options.scene.points;
+
+    PointCloud cloud;
+    Scene scene;
+    SceneGenerator::generate(options.scene, cloud, scene);
+
+    std::cout << cloud.size() << " points, " << options.scene.planes << " planes, noise " << options.scene.noise
+              << ", outliers " << options.scene.outliers << ", seed " << options.scene.seed
+              << ", " << scheduler.threadCount() << " threads, " << PlaneKernels::isaName(PlaneKernels::isa()) << std::endl;
+
+    auto nothing = [](){};
+
+    {
+        PointCloud c;
+        Scene s;
+        bench.run("generate", n, "pts", [&](){c = PointCloud(); s = Scene();}, [&](){SceneGenerator::generate(options.scene, c, s);});
+    }
+
+    // Input and output.
+    Ply ply;
+    for (Ply::Format format : {Ply::BinaryLittleEndian, Ply::Ascii})
+    {
+        std::string suffix = format == Ply::Ascii ? "ascii" : "binary";
+        PointCloud c;
+        bool written = bench.run("ply_write_" + suffix, n, "pts", nothing, [&](){ply.write(options.tmp, cloud, format);});
+        if (!written && (std::string("ply_read_") + suffix).find(options.filter) != std::string::npos)
+            ply.write(options.tmp, cloud, format);
+        bench.run("ply_read_" + suffix, n, "pts", [&](){c = PointCloud();}, [&](){ply.read(options.tmp, c, scheduler);});
+    }
+    std::remove(options.tmp.c_str());
+
+    // Spatial indexes.
+    bench.run("octree_build", n, "pts", nothing, [&](){Octree octree(cloud, 30);});
+    bench.run("linear_octree_build", n, "pts", nothing, [&](){LinearOctree octree(cloud, options.leafCapacity, scheduler);});
+
+    // Downsampling.
+    {
+        PointCloud reduced;
+        std::vector<PointIndex> mapping;
+        if (bench.run("voxel_grid", n, "pts", nothing, [&](){VoxelGrid::downsample(cloud, options.voxelSize, reduced, mapping, scheduler);}))
+            std::cout << "    " << reduced.size() << " points kept" << std::endl;
+    }
+
+    // Normals, and the cloud with them for the benchmarks that use them.
+    PointCloud oriented = cloud;
+    bool estimated = bench.run("normal_estimation", n, "pts", [&](){oriented = cloud;}, [&](){
+        NormalEstimation::estimate(oriented, options.normalNeighbors, scheduler);
+    });
+    if (!estimated)
+        NormalEstimation::estimate(oriented, options.normalNeighbors, scheduler);
+    DetectionParams normalParams = options.params;
+    normalParams.steps = options.normalSteps;
+
+    // Scoring of a hypothesis against every point.
+    std::vector<unsigned char> mask(cloud.size());
+    PlaneKernels::Isa isa = PlaneKernels::isa();
+    for (PlaneKernels::Isa i : {PlaneKernels::Scalar, PlaneKernels::Sse2, PlaneKernels::Avx2})
+    {
+        if (PlaneKernels::setIsa(i) != i || scene.normals.empty())
+            continue;
+        bench.run(std::string("classify_") + PlaneKernels::isaName(i), n, "pts", nothing, [&](){
+            PlaneKernels::classify(cloud.x().data(), cloud.y().data(), cloud.z().data(), cloud.size(), scene.normals[0], scene.offsets[0], options.params.epsilon, mask.data());
+        });
+        bench.run(std::string("agree_") + PlaneKernels::isaName(i), n, "pts", [&](){std::fill(mask.begin(), mask.end(), 1);}, [&](){
+            PlaneKernels::agree(oriented.normalX().data(), oriented.normalY().data(), oriented.normalZ().data(), oriented.size(), scene.normals[0], normalParams.normalCos, mask.data());
+        });
+    }
+    PlaneKernels::setIsa(isa);
+
+    // Blocks of neighbouring points, as found in the leaves of the octree.
+    std::vector<std::vector<PointIndex>> blocks;
+    {
+        LinearOctree octree(cloud, options.leafCapacity, scheduler);
+        const std::vector<PointIndex>& sorted = octree.points();
+        for (std::size_t i = 0 ; i + options.blockSize <= sorted.size() && blocks.size() < 1000 ; i += options.blockSize)
+            blocks.emplace_back(sorted.begin() + i, sorted.begin() + i + options.blockSize);
+    }
+
+    {
+        std::vector<std::vector<PointIndex>> pts;
+        UnionFindPlanes colors;
+        bench.run("ransac_block", double(blocks.size()) * options.blockSize, "pts", [&](){pts = blocks; colors = cloud.colors();}, [&](){
+            for (std::size_t i = 0 ; i < pts.size() ; ++i)
+                Ransac::ransac(cloud, pts[i], options.params, i, colors, scheduler);
+        });
+    }
+
+    {
+        std::vector<std::vector<PointIndex>> pts;
+        UnionFindPlanes colors;
+        bench.run("ransac_block_normals", double(blocks.size()) * options.blockSize, "pts", [&](){pts = blocks; colors = oriented.colors();}, [&](){
+            for (std::size_t i = 0 ; i < pts.size() ; ++i)
+                Ransac::ransac(oriented, pts[i], normalParams, i, colors, scheduler);
+        });
+    }
+
+    {
+        std::vector<Plane> planes;
+        for (std::size_t i = 0 ; i < blocks.size() && i < 500 ; ++i)
+            planes.emplace_back(cloud, blocks[i]);
+        double pairs = planes.size() * (planes.size() - 1) / 2.0;
+        std::size_t mergeable = 0;
+        bench.run("plane_mergeable", pairs, "pairs", [&](){mergeable = 0;}, [&](){
+            for (std::size_t i = 0 ; i < planes.size() ; ++i)
+                for (std::size_t j = i + 1 ; j < planes.size() ; ++j)
+                    mergeable += planes[i].mergeableWith(planes[j], options.params.dCos);
+        });
+    }
+
+    // Whole detection, and projection of the points on the planes found.
+    PointCloud copy;
+    std::vector<SharedPlane> planes;
+    auto reset = [&](){copy = cloud; planes.clear();};
+    auto detect = [&](const auto& octree) {
+        std::default_random_engine generator;
+        octree.detectPlanes(options.params, generator, planes, copy.colors(), scheduler);
+    };
+
+    if (bench.run("detect_octree", n, "pts", reset, [&](){detect(Octree(copy, 30));}))
+        printQuality(SceneGenerator::evaluate(scene, planes, copy.colors()), options.scene.planes);
+
+    if (bench.run("detect_linear_octree", n, "pts", reset, [&](){detect(LinearOctree(copy, options.leafCapacity, scheduler));}))
+        printQuality(SceneGenerator::evaluate(scene, planes, copy.colors()), options.scene.planes);
+
+    // Normals estimated as part of the detection, with fewer hypotheses.
+    {
+        std::vector<SharedPlane> normalPlanes;
+        auto resetNormals = [&](){copy = cloud; normalPlanes.clear();};
+        if (bench.run("detect_normals", n, "pts", resetNormals, [&](){
+            NormalEstimation::estimate(copy, options.normalNeighbors, scheduler);
+            LinearOctree octree(copy, options.leafCapacity, scheduler);
+            std::default_random_engine generator;
+            octree.detectPlanes(normalParams, generator, normalPlanes, copy.colors(), scheduler);
+        }))
+            printQuality(SceneGenerator::evaluate(scene, normalPlanes, copy.colors()), options.scene.planes);
+    }
+
+    if (planes.empty() && std::string("flatten").find(options.filter) != std::string::npos)
+    {
+        reset();
+        detect(LinearOctree(copy, options.leafCapacity, scheduler));
+    }
+    // Incremental detection: the points near the first one, as seen from a new view, arrive
+    // after the others were processed.
+    {
+        std::vector<PointIndex> early;
+        std::vector<PointIndex> late;
+        double reach = cloud.halfDimension().x / 5;
+        for (PointIndex i = 0 ; i < cloud.size() ; ++i)
+            (cloud.point(i).distance(cloud.point(0)) < reach ? late : early).push_back(i);
+
+        PointCloud grown;
+        std::unique_ptr<Octree> octree;
+        std::vector<SharedPlane> updated;
+        bench.run("octree_update", late.size(), "pts", [&](){
+            grown = PointCloud();
+            for (PointIndex i : early)
+                grown.addPoint(cloud.point(i), cloud.color(i));
+            grown.boundingBox();
+            octree.reset(new Octree(grown, 30));
+            updated.clear();
+            std::default_random_engine generator;
+            octree->detectPlanes(options.params, generator, updated, grown.colors(), scheduler);
+            // The first update records the plane of every point.
+            octree->updatePlanes(options.params, generator, updated, grown.colors(), scheduler);
+            PointIndex begin = grown.size();
+            for (PointIndex i : late)
+                grown.addPoint(cloud.point(i), cloud.color(i));
+            octree->insert(begin, grown.size());
+        }, [&](){
+            std::default_random_engine generator;
+            octree->updatePlanes(options.params, generator, updated, grown.colors(), scheduler);
+        });
+    }
+
+    double flattened = 0;
+    for (auto&& p : planes)
+        flattened += p->getCount();
+    PointCloud detected = copy;
+    bench.run("flatten", flattened, "pts", [&](){copy = detected;}, [&](){
+        for (auto&& p : planes)
+            p->flatten(copy);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1 ; i < argc ; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--points" && i + 1 < argc)
+            options.scene.points = std::stoull(argv[++i]);
+        else if (arg == "--planes" && i + 1 < argc)
+            options.scene.planes = std::stoi(argv[++i]);
+        else if (arg == "--min-size" && i + 1 < argc)
+            options.scene.minSize = std::stod(argv[++i]);
+        else if (arg == "--max-size" && i + 1 < argc)
+            options.scene.maxSize = std::stod(argv[++i]);
+        else if (arg == "--noise" && i + 1 < argc)
+            options.scene.noise = std::stod(argv[++i]);
+        else if (arg == "--outliers" && i + 1 < argc)
+            options.scene.outliers = std::stod(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            options.scene.seed = std::stoull(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            options.threads = std::stoi(argv[++i]);
+        else if (arg == "--repeat" && i + 1 < argc)
+            options.repeat = std::stoi(argv[++i]);
+        else if (arg == "--filter" && i + 1 < argc)
+            options.filter = argv[++i];
+        else if (arg == "--leaf-capacity" && i + 1 < argc)
+            options.leafCapacity = std::stoi(argv[++i]);
+        else if (arg == "--block-size" && i + 1 < argc)
+            options.blockSize = std::stoi(argv[++i]);
+        else if (arg == "--voxel-size" && i + 1 < argc)
+            options.voxelSize = std::stod(argv[++i]);
+        else if (arg == "--normals" && i + 1 < argc)
+            options.normalNeighbors = std::stoi(argv[++i]);
+        else if (arg == "--normal-steps" && i + 1 < argc)
+            options.normalSteps = std::stoi(argv[++i]);
+        else if (arg == "--tmp" && i + 1 < argc)
+            options.tmp = argv[++i];
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--points N] [--planes N] [--min-size S] [--max-size S] [--noise S] [--outliers F] [--seed N]"
+                      << " [--threads N] [--repeat N] [--filter NAME] [--leaf-capacity N] [--block-size N] [--voxel-size S]"
+                      << " [--normals K] [--normal-steps N] [--tmp FILE]" << std::endl;
+            return 1;
+        }
+    }
+
+    runBenchmarks(options);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Queue of at most capacity items between threads, in first-in first-out order.
+// A producer waits while it is full, a consumer while it is empty and not closed.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) :
+        mCapacity(capacity), mClosed(false) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Add an item, waiting for room.
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotFull.wait(lock, [this]() {return mItems.size() < mCapacity;});
+        mItems.push_back(std::move(item));
+        mNotEmpty.notify_one();
+    }
+
+    // Take the oldest item, waiting for one. Return false once the queue is closed and empty.
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotEmpty.wait(lock, [this]() {return mClosed || !mItems.empty();});
+        if (mItems.empty())
+            return false;
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    // Tell the consumers that no more items will be pushed.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mClosed = true;
+        mNotEmpty.notify_all();
+    }
+
+private:
+    std::size_t mCapacity;
+    bool mClosed;
+    std::deque<T> mItems;
+    std::mutex mMutex;
+    std::condition_variable mNotFull;
+    std::condition_variable mNotEmpty;
+};
+
+#endif // BOUNDED_QUEUE_H
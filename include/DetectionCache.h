@@ -0,0 +1,37 @@
+#ifndef DETECTION_CACHE_H
+#define DETECTION_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "DetectionParams.h"
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// Binary file holding the result of a detection: the cloud, the downsampled cloud the
+// planes were detected in if any, and the planes with their statistics and members.
+// It is read through a memory mapping, so that a rerun with the same input and
+// parameters skips parsing and detection.
+class DetectionCache
+{
+public:
+    // Hash of the contents of a file, hashed in parallel chunks. Return false if it cannot be read.
+    static bool hashFile(const std::string& filename, std::uint64_t& hash, TaskScheduler& scheduler);
+    // Hash of the parameters the planes depend on.
+    static std::uint64_t hashParams(const DetectionParams& params);
+    // Hash of value combined with hash, for the parameters that are not in DetectionParams.
+    static std::uint64_t combine(std::uint64_t hash, double value);
+
+    // Save a detection. The planes were detected in reduced if mapping is not empty, which
+    // maps each point of cloud to a point of reduced, and in cloud otherwise.
+    static bool write(const std::string& filename, std::uint64_t inputHash, std::uint64_t paramsHash,
+                      PointCloud& cloud, PointCloud& reduced, const std::vector<PointIndex>& mapping,
+                      const std::vector<SharedPlane>& planes);
+    // Load a detection saved with the same hashes and the same version of the format.
+    // Return false, leaving the arguments empty, if there is none.
+    static bool read(const std::string& filename, std::uint64_t inputHash, std::uint64_t paramsHash,
+                     PointCloud& cloud, PointCloud& reduced, std::vector<PointIndex>& mapping,
+                     std::vector<SharedPlane>& planes);
+};
+
+#endif // DETECTION_CACHE_H
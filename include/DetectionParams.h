@@ -0,0 +1,42 @@
+#ifndef DETECTION_PARAMS_H
+#define DETECTION_PARAMS_H
+
+#include <cmath>
+
+// Parameters of the plane detection.
+struct DetectionParams
+{
+    // Nodes with at most this many points are searched with RANSAC.
+    int depthThreshold = 100;
+    // Inlier distance, relative to the spread of the points of a leaf.
+    double epsilon = 0.05;
+    // Points sampled to build a RANSAC hypothesis.
+    int numStartPoints = 10;
+    // Minimum number of inliers of a plane.
+    int numPoints = 30;
+    // RANSAC hypotheses per plane; the maximum if adaptive.
+    int steps = 10;
+    // Planes with fewer points than this ratio of the largest one are dropped.
+    double countRatio = 0.005;
+    // Cosine of the largest angle between mergeable planes.
+    double dCos = std::cos(3.1415/180 * 15);
+    // Merge the planes of the whole tree again once it is done.
+    bool globalMerge = false;
+    // Dirty subtrees with at most this many points are detected again as a whole by Octree::updatePlanes.
+    int updateRegion = 10000;
+
+    // Stop RANSAC once a plane with the best inlier ratio seen so far would have been found with this probability. 0 disables it.
+    double confidence = 0;
+    // Score hypotheses on this many random points first. 0 disables it.
+    int preemptiveSubset = 0;
+    // Fully evaluate a hypothesis only if its inlier ratio on the subset is at least this fraction of the best one.
+    double preemptiveRatio = 0.8;
+
+    // Only used when the cloud has normals. Cosine of the largest angle between the normal of a
+    // point and that of the seed of a sample, or of the plane it is an inlier of.
+    double normalCos = std::cos(3.1415/180 * 30);
+    // Only used when the cloud has normals. Points with a larger curvature do not seed samples.
+    double maxCurvature = 0.05;
+};
+
+#endif // DETECTION_PARAMS_H
@@ -0,0 +1,55 @@
+#ifndef LINEAR_OCTREE_H
+#define LINEAR_OCTREE_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "DetectionParams.h"
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// Octree stored as a flat array of nodes over the points sorted by Morton code.
+// Each node owns a contiguous range of the sorted points.
+class LinearOctree {
+public:
+    // Deepest level that Morton codes can address.
+    static constexpr unsigned int MaxDepth = 21;
+
+    // Build the tree, splitting nodes with more than leafCapacity points until maxdepth.
+    LinearOctree(const PointCloud& cloud, unsigned int leafCapacity, TaskScheduler& scheduler, unsigned int maxdepth = MaxDepth);
+
+    // Detect planes in the point cloud, subtrees in parallel. Same parameters as Octree::detectPlanes.
+    void detectPlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const;
+
+    inline std::size_t nodeCount() const
+        {return mNodes.size();}
+    // Point indices in Morton order.
+    inline const std::vector<PointIndex>& points() const
+        {return mPoints;}
+
+private:
+    struct Node
+    {
+        // Range of mPoints in the subtree.
+        std::uint32_t begin;
+        std::uint32_t end;
+        // Index of the first child, the children of a node are contiguous.
+        std::uint32_t firstChild;
+        // Octants that have a child, 0 for leaves.
+        std::uint8_t childMask;
+    };
+
+    void build(std::uint32_t node, const std::vector<std::uint64_t>& codes, unsigned int depth, unsigned int maxdepth, unsigned int leafCapacity);
+    void detectPlanes(std::uint32_t node, unsigned int depth, const DetectionParams& params, std::uint32_t seed, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const;
+
+    // Morton code of every point, relative to the bounding box of the cloud.
+    static void computeCodes(const PointCloud& cloud, std::vector<std::uint64_t>& codes, TaskScheduler& scheduler);
+    // Stable parallel LSD radix sort of points by code.
+    static void sortByCode(std::vector<std::uint64_t>& codes, std::vector<PointIndex>& points, TaskScheduler& scheduler);
+
+    const PointCloud& mCloud;
+    std::vector<PointIndex> mPoints;
+    std::vector<Node> mNodes;
+};
+
+#endif // LINEAR_OCTREE_H
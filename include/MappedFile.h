@@ -0,0 +1,37 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Map the file. Return false if it cannot be opened or mapped.
+    bool open(const std::string& filename);
+    // Unmap the file.
+    void close();
+    // Drop the pages before offset from memory. They are read again if accessed.
+    void release(std::size_t offset) const;
+
+    inline bool isOpen() const
+        {return mFd >= 0;}
+    inline const char* data() const
+        {return mData;}
+    inline std::size_t size() const
+        {return mSize;}
+
+private:
+    int mFd;
+    const char* mData;
+    std::size_t mSize;
+};
+
+#endif // MAPPED_FILE_H
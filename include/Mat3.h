@@ -0,0 +1,136 @@
+#ifndef Mat3_h_
+#define Mat3_h_
+
+#include "Vec3.h"
+#include <cmath>
+#include <limits>
+#include <utility>
+
+// 3x3 matrix, row-major.
+template <typename T>
+struct Mat3 {
+    T D[3][3];
+
+    inline Mat3()
+        {for (int i = 0 ; i < 3 ; ++i) for (int j = 0 ; j < 3 ; ++j) D[i][j] = 0;}
+    inline Mat3(T a00, T a01, T a02, T a10, T a11, T a12, T a20, T a21, T a22)
+    {
+        D[0][0] = a00; D[0][1] = a01; D[0][2] = a02;
+        D[1][0] = a10; D[1][1] = a11; D[1][2] = a12;
+        D[2][0] = a20; D[2][1] = a21; D[2][2] = a22;
+    }
+
+    static inline Mat3 identity()
+        {return Mat3(1, 0, 0, 0, 1, 0, 0, 0, 1);}
+    // u * v^T
+    static inline Mat3 outer(const Vec3<T>& u, const Vec3<T>& v)
+        {return Mat3(u.x*v.x, u.x*v.y, u.x*v.z, u.y*v.x, u.y*v.y, u.y*v.z, u.z*v.x, u.z*v.y, u.z*v.z);}
+
+    inline T& operator()(int i, int j)
+        {return D[i][j];}
+    inline const T& operator()(int i, int j) const
+        {return D[i][j];}
+
+    inline Mat3 operator+(const Mat3& m) const
+        {Mat3 r = *this; return r += m;}
+    inline Mat3 operator-(const Mat3& m) const
+        {Mat3 r = *this; return r -= m;}
+    inline Mat3& operator+=(const Mat3& m)
+        {for (int i = 0 ; i < 3 ; ++i) for (int j = 0 ; j < 3 ; ++j) D[i][j] += m.D[i][j]; return *this;}
+    inline Mat3& operator-=(const Mat3& m)
+        {for (int i = 0 ; i < 3 ; ++i) for (int j = 0 ; j < 3 ; ++j) D[i][j] -= m.D[i][j]; return *this;}
+    inline Mat3 operator*(T t) const
+        {Mat3 r = *this; for (int i = 0 ; i < 3 ; ++i) for (int j = 0 ; j < 3 ; ++j) r.D[i][j] *= t; return r;}
+    inline Mat3 operator/(T t) const
+        {return *this * (1 / t);}
+
+    inline Vec3<T> operator*(const Vec3<T>& v) const
+    {
+        return Vec3<T>(
+                D[0][0] * v.x + D[0][1] * v.y + D[0][2] * v.z,
+                D[1][0] * v.x + D[1][1] * v.y + D[1][2] * v.z,
+                D[2][0] * v.x + D[2][1] * v.y + D[2][2] * v.z);
+    }
+
+    Mat3 operator*(const Mat3& m) const
+    {
+        Mat3 r;
+        for (int i = 0 ; i < 3 ; ++i)
+            for (int j = 0 ; j < 3 ; ++j)
+                r.D[i][j] = D[i][0] * m.D[0][j] + D[i][1] * m.D[1][j] + D[i][2] * m.D[2][j];
+        return r;
+    }
+
+    inline Mat3 transposed() const
+        {return Mat3(D[0][0], D[1][0], D[2][0], D[0][1], D[1][1], D[2][1], D[0][2], D[1][2], D[2][2]);}
+
+    // v^T * M * v
+    inline T quadratic(const Vec3<T>& v) const
+        {return v * (*this * v);}
+
+    // Eigen decomposition of a symmetric matrix with cyclic Jacobi rotations.
+    // Eigenvalues are sorted in descending order, vectors holds the matching unit eigenvectors as rows.
+    void eigenSymmetric(Vec3<T>& values, Mat3& vectors) const
+    {
+        Mat3 a = *this;
+        Mat3 v = identity();
+
+        for (int sweep = 0 ; sweep < 32 ; ++sweep)
+        {
+            T off = a.D[0][1] * a.D[0][1] + a.D[0][2] * a.D[0][2] + a.D[1][2] * a.D[1][2];
+            T diag = a.D[0][0] * a.D[0][0] + a.D[1][1] * a.D[1][1] + a.D[2][2] * a.D[2][2];
+            if (off <= diag * std::numeric_limits<T>::epsilon() * std::numeric_limits<T>::epsilon() || off == 0)
+                break;
+
+            for (int p = 0 ; p < 2 ; ++p)
+            {
+                for (int q = p + 1 ; q < 3 ; ++q)
+                {
+                    if (a.D[p][q] == 0)
+                        continue;
+                    // Rotation that zeroes a(p, q).
+                    T theta = (a.D[q][q] - a.D[p][p]) / (2 * a.D[p][q]);
+                    T t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                    T c = 1 / std::sqrt(t * t + 1);
+                    T s = t * c;
+
+                    for (int k = 0 ; k < 3 ; ++k)
+                    {
+                        T akp = a.D[k][p], akq = a.D[k][q];
+                        a.D[k][p] = c * akp - s * akq;
+                        a.D[k][q] = s * akp + c * akq;
+                    }
+                    for (int k = 0 ; k < 3 ; ++k)
+                    {
+                        T apk = a.D[p][k], aqk = a.D[q][k];
+                        a.D[p][k] = c * apk - s * aqk;
+                        a.D[q][k] = s * apk + c * aqk;
+                    }
+                    for (int k = 0 ; k < 3 ; ++k)
+                    {
+                        T vkp = v.D[k][p], vkq = v.D[k][q];
+                        v.D[k][p] = c * vkp - s * vkq;
+                        v.D[k][q] = s * vkp + c * vkq;
+                    }
+                }
+            }
+        }
+
+        int order[3] = {0, 1, 2};
+        for (int i = 0 ; i < 3 ; ++i)
+            for (int j = i + 1 ; j < 3 ; ++j)
+                if (a.D[order[j]][order[j]] > a.D[order[i]][order[i]])
+                    std::swap(order[i], order[j]);
+
+        for (int i = 0 ; i < 3 ; ++i)
+        {
+            values[i] = a.D[order[i]][order[i]];
+            for (int k = 0 ; k < 3 ; ++k)
+                vectors.D[i][k] = v.D[k][order[i]];
+        }
+    }
+};
+
+typedef Mat3<double> Mat3d;
+
+#endif
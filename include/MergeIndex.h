@@ -0,0 +1,47 @@
+#ifndef MERGE_INDEX_H
+#define MERGE_INDEX_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Plane.h"
+
+// Bins of planes by normal direction, on a grid over the unit sphere, and by
+// offset along the normal, to find the planes that may be mergeable with a
+// plane without testing all of them.
+class MergeIndex
+{
+public:
+    // Empty index for the planes of the vector, whose centers stay in the ball around the
+    // current ones, for planes at most acos(dCos) apart.
+    MergeIndex(const std::vector<SharedPlane>& planes, double dCos);
+
+    // Index planes[i], which must not change afterwards.
+    void insert(std::uint32_t i);
+
+    // Indices of the indexed planes that may be mergeable with p, in increasing order.
+    // The others are not mergeable with p.
+    void candidates(const Plane& p, std::vector<std::uint32_t>& indices) const;
+
+private:
+    // Cell of a unit normal along axis a.
+    int normalCell(double n) const;
+    // Key of a bin.
+    std::int64_t key(int x, int y, int z, std::int64_t e) const;
+
+    const std::vector<SharedPlane>& mPlanes;
+    // Largest distance between two mergeable unit normals.
+    double mChord;
+    // Cells of the normals along each axis, and their size.
+    int mCells;
+    double mCellSize;
+    // Offsets are measured from mOrigin, planes have their centers within mReach of it.
+    Vec3d mOrigin;
+    double mReach;
+    double mOffsetSize;
+    // Largest thickness of the indexed planes.
+    double mMaxThickness;
+    std::unordered_map<std::int64_t, std::vector<std::uint32_t>> mBins;
+};
+
+#endif // MERGE_INDEX_H
@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Process wide wall times and counters of the detection stages, safe to update from
+// any thread, and their report as JSON.
+class Metrics
+{
+public:
+    enum Counter
+    {
+        HypothesesTried,
+        // Discarded after scoring on the preemptive subset.
+        HypothesesPreempted,
+        // Discarded before scoring because the normals of their sample disagree.
+        HypothesesRejected,
+        // With enough inliers to be refit.
+        HypothesesAccepted,
+        MergesAttempted,
+        MergesPerformed,
+        PlanesRemoved,
+        PointsReassigned,
+        // Points accepted by a plane in the final pass.
+        PointsAccepted,
+        CounterCount
+    };
+
+    // Deepest octree level tracked, deeper nodes are counted with it.
+    static const unsigned int MaxDepth = 31;
+
+    // Measure the time from construction to stop() or destruction, and add it to a stage,
+    // or to the nodes of an octree level.
+    class Timer
+    {
+    public:
+        Timer(const char* stage);
+        explicit Timer(unsigned int depth);
+        ~Timer();
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        void stop();
+
+    private:
+        const char* mStage;
+        unsigned int mDepth;
+        bool mRunning;
+        std::chrono::steady_clock::time_point mStart;
+    };
+
+    static void add(Counter counter, std::uint64_t n = 1);
+    // Add to the time of a stage. Stages are reported in the order they first appear.
+    static void addTime(const std::string& stage, double seconds);
+    // Add the time spent detecting or merging in one node, without its children.
+    static void addNode(unsigned int depth, double seconds);
+    // Record a value describing the run, such as the number of points.
+    static void setValue(const std::string& name, double value);
+    static void reset();
+
+    static std::uint64_t counter(Counter counter);
+    static const char* counterName(Counter counter);
+    // Peak resident memory of the process, in bytes.
+    static std::size_t peakMemory();
+
+    static bool writeJson(const std::string& filename);
+};
+
+#endif // METRICS_H
@@ -0,0 +1,22 @@
+#ifndef NORMAL_ESTIMATION_H
+#define NORMAL_ESTIMATION_H
+
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// Normal and curvature of every point of a cloud, from the covariance of its k nearest
+// neighbours, the point itself included. The normal is the direction of least variance and
+// the curvature is the smallest eigenvalue over the sum of the three, from 0 on a plane to
+// 1/3 for isotropic neighbours.
+class NormalEstimation
+{
+public:
+    // Find the neighbours of the points with a k-d tree over the cloud, estimate their normals
+    // in parallel and store them in the cloud. Ties between neighbours at the same distance are
+    // broken by their order in the tree, so the result does not depend on the number of
+    // threads. Points whose neighbours all share their position get a zero normal and the
+    // largest curvature.
+    static void estimate(PointCloud& cloud, unsigned int k, TaskScheduler& scheduler);
+};
+
+#endif // NORMAL_ESTIMATION_H
@@ -3,15 +3,30 @@
 
 #include <vector>
 #include <random>
+#include "DetectionParams.h"
 #include "PointCloud.h"
+#include "TaskScheduler.h"
+#include "UnionFind.h"
 
 // Octree
 class Octree {
 public:
     Octree(const PointCloud& cloud, unsigned int maxdepth);
 
-    // Detect planes in the point cloud.
-    void detectPlanes(int depthThreshold, double epsilon, int numStartPoints, int numPoints, int steps, double countRatio, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, double dCos) const;
+    // Detect planes in the point cloud, subtrees in parallel. The result only depends on the generator state, not on the number of threads.
+    void detectPlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const;
+
+    // Insert the points [begin, end), added to the cloud after the octree was built.
+    // The nodes they reach are marked dirty.
+    void insert(PointIndex begin, PointIndex end);
+
+    // Detect planes again in the dirty subtrees only, after detectPlanes. planes holds the
+    // planes found before, listing their points in colors on the first call, and is replaced
+    // by the new ones. The points of the dirty subtrees are taken out of the planes they
+    // belonged to, and the planes found in these subtrees are merged with the others.
+    // The cost depends on the size of the dirty subtrees, except for the first call, which
+    // records the plane of every point. Planes no longer list their points afterwards.
+    void updatePlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler);
 
 private:
     // Node of the tree
@@ -20,29 +35,43 @@ private:
         Node(const Vec3d& origin, const Vec3d& halfDimension);
 
         // Insert a point with max recursion depth. Return false if max depth reached, true otherwise.
-        bool insert(SharedPoint p, unsigned int maxdepth);
-        
-        // Detect planes in this subtree.
-        void detectPlanes(int depthThreshold, double epsilon, int numStartPoints, int numPoints, int steps, double countRatio, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, double dCos, std::vector<SharedPoint>& pts) const;
+        // The nodes on the way are marked dirty.
+        bool insert(const PointCloud& cloud, PointIndex p, unsigned int maxdepth);
 
-        // Remove planes that have too few points, according to countRatio.
-        static void removeSmallPlanes(std::vector<SharedPlane>& planes, double countRatio, UnionFind<SharedPoint, std::pair<RGB, bool>>& colors);
+        // Collect the largest dirty subtrees with at most maxCount points, or dirty leaves, with their depth, and clean the tree.
+        void collectDirty(unsigned int maxCount, unsigned int depth, std::vector<std::pair<const Node*, unsigned int>>& subtrees);
+        void clearDirty();
 
-    private:
+        void getPoints(std::vector<PointIndex>& pts) const;
+        
+        // Detect planes in this subtree, with random numbers drawn from seed.
+        void detectPlanes(const PointCloud& cloud, const DetectionParams& params, std::uint32_t seed, unsigned int depth, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, std::vector<PointIndex>& pts, TaskScheduler& scheduler) const;
 
-        void getPoints(std::vector<SharedPoint>& pts) const;
+    private:
         bool isLeafNode() const;
-        int findOctant(SharedPoint p) const;
+        int findOctant(const Point& p) const;
 
         Vec3d center;
         Vec3d halfSize;
 
         std::shared_ptr<Node> children[8];
-        SharedPoint point;
+        PointIndex point;
         unsigned int count;
+        bool dirty;
     };
 
+    // Index in mPlanes of the plane of point p, or NoPlane.
+    std::uint32_t owner(PointIndex p) const;
+
+    const PointCloud& mCloud;
+    unsigned int mMaxDepth;
     Node mRoot;
+
+    // Plane of each point, for updatePlanes, as an index in mPlanes that mGroups maps to the
+    // plane it was merged into. Planes that were merged or removed are null.
+    std::vector<std::uint32_t> mOwner;
+    std::vector<SharedPlane> mPlanes;
+    FlatUnionFind<std::uint32_t> mGroups;
 };
 
 #endif
@@ -0,0 +1,52 @@
+#ifndef PARAMETER_SWEEP_H
+#define PARAMETER_SWEEP_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "DetectionParams.h"
+#include "Plane.h"
+#include "TaskScheduler.h"
+#include "UnionFind.h"
+
+// Detection of planes in one cloud with several sets of parameters, which share the
+// parsed cloud and its octree, and summary of the planes found with each set.
+class ParameterSweep
+{
+public:
+    // Detect planes with the parameters, labeling the points in colors.
+    typedef std::function<void(const DetectionParams& params, std::vector<SharedPlane>& planes, UnionFindPlanes& colors)> Detector;
+
+    // Read the sets from a file. Each line lists parameters as name=value, where value may be
+    // a comma-separated list, and stands for every combination of the values. The parameters a
+    // line does not list keep their value in defaults. Return false on a syntax error.
+    bool read(const std::string& filename, const DetectionParams& defaults);
+    // Detect planes with every set concurrently, each one labeling its own copy of colors,
+    // and count the planes of at least minPoints points.
+    void run(const UnionFindPlanes& colors, std::size_t points, unsigned int minPoints, const Detector& detector, TaskScheduler& scheduler);
+    // Print the summary and save it as tab-separated values.
+    bool write(const std::string& filename) const;
+
+    inline std::size_t size() const
+        {return mSets.size();}
+
+private:
+    struct Set
+    {
+        DetectionParams params;
+        // Parameters as written in the file.
+        std::string name;
+        std::size_t planes;
+        std::size_t largePlanes;
+        // Ratio of the points that belong to a plane.
+        double coverage;
+        double seconds;
+    };
+
+    // Set the parameter called name. Return false if there is none.
+    static bool setParam(DetectionParams& params, const std::string& name, double value);
+
+    std::vector<Set> mSets;
+};
+
+#endif // PARAMETER_SWEEP_H
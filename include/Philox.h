@@ -0,0 +1,79 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011). The i-th number of
+// a stream only depends on the key, the stream and i, so that streams can be drawn from
+// in any order, on any thread, with the same result.
+class Philox
+{
+public:
+    Philox(std::uint64_t key, std::uint64_t stream) :
+        mStream(stream), mCounter(0), mUsed(4)
+    {
+        mKey[0] = std::uint32_t(key);
+        mKey[1] = std::uint32_t(key >> 32);
+    }
+
+    // Next 32 random bits.
+    std::uint32_t next()
+    {
+        if (mUsed == 4)
+        {
+            std::uint32_t counter[4] = {std::uint32_t(mCounter), std::uint32_t(mCounter >> 32), std::uint32_t(mStream), std::uint32_t(mStream >> 32)};
+            block(counter, mKey, mBlock);
+            ++mCounter;
+            mUsed = 0;
+        }
+        return mBlock[mUsed++];
+    }
+
+    // Integer in [0, n).
+    std::uint32_t below(std::uint32_t n)
+    {
+        return std::uint32_t((std::uint64_t(this->next()) * n) >> 32);
+    }
+
+    // Four random words for a counter and a key.
+    static void block(const std::uint32_t counter[4], const std::uint32_t key[2], std::uint32_t out[4])
+    {
+        std::uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+        std::uint32_t k[2] = {key[0], key[1]};
+        for (int round = 0 ; round < 10 ; ++round)
+        {
+            std::uint64_t p0 = std::uint64_t(0xD2511F53u) * c[0];
+            std::uint64_t p1 = std::uint64_t(0xCD9E8D57u) * c[2];
+            std::uint32_t next[4] = {
+                std::uint32_t(p1 >> 32) ^ c[1] ^ k[0],
+                std::uint32_t(p1),
+                std::uint32_t(p0 >> 32) ^ c[3] ^ k[1],
+                std::uint32_t(p0)
+            };
+            for (int i = 0 ; i < 4 ; ++i)
+                c[i] = next[i];
+            k[0] += 0x9E3779B9u;
+            k[1] += 0xBB67AE85u;
+        }
+        for (int i = 0 ; i < 4 ; ++i)
+            out[i] = c[i];
+    }
+
+private:
+    std::uint32_t mKey[2];
+    std::uint64_t mStream;
+    std::uint64_t mCounter;
+    std::uint32_t mBlock[4];
+    int mUsed;
+};
+
+// splitmix64 finalizer (Steele et al. 2014): every bit of the result depends on every bit
+// of key, so that neighbouring keys are spread apart.
+inline std::uint64_t mix64(std::uint64_t key)
+{
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    return key ^ (key >> 31);
+}
+
+#endif // PHILOX_H
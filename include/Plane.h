@@ -1,56 +1,91 @@
 #ifndef PLANE_H
 #define PLANE_H
 
+#include "Mat3.h"
 #include "Point.h"
 #include "RGB.h"
 #include "UnionFind.h"
 #include <vector>
 #include <iostream>
-#include <opencv2/core/core.hpp>
+
+class PointCloud;
 
 class Plane
 {
     // Print the plane.
     friend std::ostream& operator<<(std::ostream& os, const Plane& p);
+    // Save and load the state of the plane.
+    friend class DetectionCache;
 
 public:
     // Invalid plane.
     Plane();
     // Plane that best fit the points with least squares minimization.
-    Plane(const std::vector<SharedPoint>& pts);
+    Plane(const PointCloud& cloud, const std::vector<PointIndex>& pts);
 
     // Distance between point and plane.
-    double distance(SharedPoint p);
+    double distance(const Point& p) const;
     // Square of distance between point and plane.
-    double squareDistance(SharedPoint p);
+    double squareDistance(const Point& p) const;
     // Whether the point is close to the plane.
-    bool accept(SharedPoint p);
-
-    // Fit the plane to the points.
-    void setPoints(const std::vector<SharedPoint>& pts);
+    bool accept(const Point& p) const;
+    // Whether some point of the box [min, max] could be accepted.
+    bool mayAccept(const Vec3d& min, const Vec3d& max) const;
+    // Bounding box of the points that can be accepted.
+    void bounds(Vec3d& min, Vec3d& max) const;
+
+    // Fit the plane to the points, without making them members of the plane.
+    void setPoints(const PointCloud& cloud, const std::vector<PointIndex>& pts);
+    // Make the points the plane was fit to its members, and label them.
+    void setMembers(const std::vector<PointIndex>& pts, UnionFindPlanes& colors);
+    // Points of the plane, in the order they were added.
+    std::vector<PointIndex> members(const UnionFindPlanes& colors) const;
+    // Forget the points of the plane, keeping its statistics.
+    void clearMembers();
     // Change the color of the plane.
     void setColor(RGB color, UnionFindPlanes& colors);
     // Reset all points to their initial color.
     void destroy(UnionFindPlanes& colors);
 
     // Ajoute un point au plan (sans recalculer l'equation)
-    void addPoint(SharedPoint p, UnionFindPlanes& colors);
+    void addPoint(const PointCloud& cloud, PointIndex i, UnionFindPlanes& colors);
+    // Add a point to the statistics only (without recomputing equation).
+    void addPoint(const Point& p);
+    // Remove a point added before from the statistics (without recomputing equation).
+    void removePoint(const Point& p);
     // Compute equation and attributes of the plane (radius, thickness)
     void computeEquation();
+    // Move the plane and its statistics by offset, e.g. from the frame of its cloud to
+    // absolute coordinates. The equation is updated rather than recomputed.
+    void translate(const Vec3d& offset);
 
     // Decides whether p is mergeable with this.
     bool mergeableWith(const Plane& p, double dCos) const;
+    // Decides whether p, found on the other side of a cut through the points, is mergeable
+    // with this. A plane lying in the cut has its slab split in two, so the centers only have
+    // to be within both thicknesses along the normal.
+    bool mergeableAcross(const Plane& p, double dCos) const;
     // Merge plane p into this.
     void merge(Plane& p, UnionFindPlanes& colors);
-
-    void flatten();
+    // Merge plane p into this, when labels are not tracked. Points are forgotten.
+    void merge(Plane& p);
+
+    // Project the points of the plane onto it, in the cloud. The points are
+    // the members listed in the labels of the cloud.
+    void flatten(PointCloud& cloud);
+    // Project any points [begin, end) of the cloud onto the plane.
+    void project(PointCloud& cloud, const PointIndex* begin, const PointIndex* end) const;
     void makeConvex();
 
-    inline unsigned int getCount()
+    inline unsigned int getCount() const
         {return count;}
-    inline std::vector<SharedPoint>& points()
-        {return mPoints;}
-    inline const std::vector<SharedPoint>& segments() const
+    inline const Vec3d& getCenter() const
+        {return center;}
+    inline double getRadius() const
+        {return radius;}
+    inline double getThickness() const
+        {return thickness;}
+    inline const std::vector<Point>& segments() const
         {return mSegments;}
 
     // Plane equation : normal * X + d = 0
@@ -60,10 +95,12 @@ public:
 private:
     // Initialize plane attributes.
     void init();
-    // Add a point to the plane (without recomputing equation).
-    void addPoint(const Point& p);
+    // Add the statistics of p to this, and invalidate p.
+    void mergeStatistics(Plane& p);
     // Best fit of the plane using least squares.
     void leastSquares();
+    // Whether the plane fit to the points of both this and p is still close to each of them.
+    bool fitsMerged(const Plane& p, double dCos) const;
 
     // Distance betwen u and v along the normal.
     double distanceAlong(Vec3d u, Vec3d v) const;
@@ -71,7 +108,7 @@ private:
     double getCos(const Plane& p) const;
 
     // Matrix to compute quickly the optimal equation.
-    cv::Mat m;
+    Mat3d m;
     Vec3d sum;
     // Attributes for plane merging.
     Vec3d center;
@@ -79,12 +116,14 @@ private:
     double thickness;
 
     // One point related to the plane
-    SharedPoint point;
+    PointIndex point;
     // Number of points
     unsigned int count;
 
-    std::vector<SharedPoint> mPoints;
-    std::vector<SharedPoint> mSegments;
+    // First and last points of the plane, linked in the labels.
+    PointIndex mFirst;
+    PointIndex mLast;
+    std::vector<Point> mSegments;
 };
 
 typedef std::shared_ptr<Plane> SharedPlane;
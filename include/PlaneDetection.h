@@ -0,0 +1,47 @@
+#ifndef PLANE_DETECTION_H
+#define PLANE_DETECTION_H
+
+#include "DetectionParams.h"
+#include "Plane.h"
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Steps of the hierarchical plane detection, shared by the octree implementations.
+class PlaneDetection
+{
+public:
+    // Find up to two planes among the points of a leaf with RANSAC, with random numbers keyed by seed.
+    static void detectInLeaf(const PointCloud& cloud, const PointIndex* begin, const PointIndex* end, const DetectionParams& params, std::uint32_t seed, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler);
+
+    // Merge the planes found in the children of a node, give them the unlabeled points in [begin, end) and append the result to planes.
+    static void mergeChildren(const PointCloud& cloud, std::vector<SharedPlane>& plns, const PointIndex* begin, const PointIndex* end, const DetectionParams& params, UnionFindPlanes& colors, std::vector<SharedPlane>& planes);
+
+    // Merge mergeable planes, each into the first one of the pair, and reset the others.
+    // Return the number of merges.
+    static std::size_t mergePlanes(std::vector<SharedPlane>& plns, double dCos, UnionFindPlanes& colors);
+    // Same, only for pairs with one plane at first or after, where merge(i, j) merges plns[j] into plns[i].
+    static std::size_t mergePlanes(std::vector<SharedPlane>& plns, double dCos, std::size_t first, const std::function<void(std::uint32_t, std::uint32_t)>& merge);
+
+    // Merge the planes of the whole tree until none are mergeable, across branches too.
+    static void mergeAll(std::vector<SharedPlane>& planes, double dCos, UnionFindPlanes& colors);
+
+    // Remove planes that have too few points, according to countRatio.
+    static void removeSmallPlanes(std::vector<SharedPlane>& planes, double countRatio, UnionFindPlanes& colors);
+
+    // Give every point of the cloud to the closest plane that accepts it, if any, and project
+    // it on that plane. The members of the planes are left as they are. Points and planes are
+    // processed in parallel.
+    static void projectPoints(PointCloud& cloud, std::vector<SharedPlane>& planes, TaskScheduler& scheduler);
+    // Index in planes of the closest plane that accepts each point of the cloud, or -1.
+    static void closestPlanes(const PointCloud& cloud, const std::vector<SharedPlane>& planes, std::vector<int>& owner, TaskScheduler& scheduler);
+    // Project every point of the cloud on the plane of index owner[i], if not -1.
+    static void projectPoints(PointCloud& cloud, std::vector<SharedPlane>& planes, const std::vector<int>& owner, TaskScheduler& scheduler);
+
+    // Seed of the i-th child of a node.
+    static std::uint32_t childSeed(std::uint32_t seed, int i);
+};
+
+#endif // PLANE_DETECTION_H
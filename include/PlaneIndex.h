@@ -0,0 +1,41 @@
+#ifndef PLANE_INDEX_H
+#define PLANE_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include "Plane.h"
+
+// Uniform grid over the regions where planes accept points, to find the
+// planes that may accept a point without testing all of them.
+class PlaneIndex
+{
+public:
+    // Index the non-null planes.
+    void build(const std::vector<SharedPlane>& planes);
+
+    // Index in the indexed vector of the closest plane that accepts p, or -1. Ties go to the first plane.
+    int closest(const Point& p) const;
+
+private:
+    // What Plane::accept needs, computed the same way.
+    struct Entry
+    {
+        Vec3d normal;
+        double d;
+        Vec3d center;
+        double maxCenterDistance;
+        double maxDistance;
+    };
+
+    bool cell(const Point& p, std::size_t& c) const;
+
+    std::vector<Entry> mEntries;
+    Vec3d mMin;
+    Vec3d mCellSize;
+    int mCells[3];
+    // Planes of cell c are mCellPlanes[mCellStart[c]] to mCellPlanes[mCellStart[c + 1]], in increasing order.
+    std::vector<std::uint32_t> mCellStart;
+    std::vector<std::uint32_t> mCellPlanes;
+};
+
+#endif // PLANE_INDEX_H
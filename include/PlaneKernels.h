@@ -0,0 +1,57 @@
+#ifndef PLANE_KERNELS_H
+#define PLANE_KERNELS_H
+
+#include "Point.h"
+#include <cstddef>
+
+// Vectorized loops over contiguous coordinate arrays. The instruction set is
+// picked at run time; every variant gives the same per-point results, and adds
+// squared errors in the same order so that their sums are the same too.
+class PlaneKernels
+{
+public:
+    enum Isa
+    {
+        Scalar,
+        Sse2,
+        Avx2
+    };
+
+    // Score of a plane against a block of points.
+    struct Score
+    {
+        std::size_t count;
+        double error;
+    };
+
+    // Best instruction set supported by this CPU.
+    static Isa bestIsa();
+    // Instruction set in use.
+    static Isa isa();
+    // Use another instruction set, if supported. Return the one in use.
+    static Isa setIsa(Isa isa);
+    static const char* isaName(Isa isa);
+
+    // Points with (normal * p + d)^2 <= epsilon are inliers: set mask[i] to 1 for them, 0 otherwise,
+    // and return their count and the sum of their squared distances. For float coordinates the
+    // distances are computed in float and summed in double.
+    static Score classify(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask);
+    static Score classify(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask);
+
+    // Sum of the squared distances to the plane of the points whose mask is non-zero.
+    static double squaredError(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask);
+    static double squaredError(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask);
+
+    // Clear mask[i] for the points whose unit normal (nx[i], ny[i], nz[i]) makes an angle with normal
+    // of cosine below minCos, in absolute value, and return the number of points left in the mask.
+    static std::size_t agree(const float* nx, const float* ny, const float* nz, std::size_t n, const Vec3d& normal, double minCos, unsigned char* mask);
+
+    // Project points orthogonally on the plane of unit normal: p -= (normal * p + d) * normal.
+    static void project(double* x, double* y, double* z, std::size_t n, const Vec3d& normal, double d);
+    static void project(float* x, float* y, float* z, std::size_t n, const Vec3d& normal, double d);
+    // Same for the n distinct points x[indices[i]], y[indices[i]], z[indices[i]].
+    static void project(double* x, double* y, double* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d);
+    static void project(float* x, float* y, float* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d);
+};
+
+#endif // PLANE_KERNELS_H
@@ -1,6 +1,7 @@
 #ifndef PLY_H
 #define PLY_H
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
@@ -8,14 +9,94 @@
 #include "UnionFind.h"
 #include "PointCloud.h"
 
+class MappedFile;
+class TaskScheduler;
+
 class Ply
 {
     friend class Test;
 
 public:
-    bool write(const std::string& filename, PointCloud& cloud);
-    void read(const std::string& filename, PointCloud& cloud);
+    enum Format
+    {
+        Ascii,
+        BinaryLittleEndian
+    };
+
+    Ply();
+
+    // Write the points at their absolute position, the origin of the cloud added back.
+    bool write(const std::string& filename, PointCloud& cloud, Format format = Ascii);
+    // Read the points relative to an origin near the first one, unless the cloud has points already.
+    bool read(const std::string& filename, PointCloud& cloud);
+    // Same, parsing ASCII files in parallel.
+    bool read(const std::string& filename, PointCloud& cloud, TaskScheduler& scheduler);
+    // Call vertex for every point of the file, at its absolute position, without storing them.
+    bool read(const std::string& filename, const std::function<void(const Vec3d&, RGB)>& vertex);
+
+    // Write a file piecewise: the header for vertexCount points, then the points of one or more clouds
+    // with the given origin. Coordinates are written as double when the origin is not zero, since float
+    // would lose the precision the origin keeps.
+    bool writeHeader(std::ostream& out, std::size_t vertexCount, Format format, const Vec3d& origin = Vec3d());
+    bool writeVertices(std::ostream& out, PointCloud& cloud, Format format);
+
 private:
+    enum Type
+    {
+        Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64
+    };
+
+    // Scalar vertex property, at a fixed offset in a binary vertex record.
+    struct Property
+    {
+        std::string name;
+        Type type;
+        std::size_t offset;
+    };
+
+    // What precedes the vertex data.
+    struct Header
+    {
+        Format format;
+        std::size_t vertexCount;
+        std::size_t vertexSize;
+        // Bytes of other elements stored before the vertices (binary only).
+        std::size_t skip;
+        // Lines of other elements before the vertices (ASCII only).
+        std::size_t skipLines;
+        std::vector<Property> properties;
+        // Offset of the first byte after end_header.
+        std::size_t dataOffset;
+    };
+
+    typedef std::function<void(const Vec3d&, RGB)> Vertex;
+
+    static bool open(const std::string& filename, MappedFile& file, Header& header);
+    static bool parseHeader(const MappedFile& file, Header& header);
+    static bool parseType(const std::string& name, Type& type);
+    static std::size_t typeSize(Type type);
+    static int findProperty(const Header& header, const char* name, const char* alternative = nullptr);
+    // Properties of the coordinates, false if one is missing, and of the color channels, -1 if absent.
+    static bool findPoint(const Header& header, int* xyz, int* rgb);
+    // Value of a binary property as double, and color of a binary vertex record.
+    static double decode(const char* p, Type type);
+    static RGB decodeColor(const Header& header, const int* rgb, const char* record);
+
+    // Parse the vertex lines in [begin, end), ignoring blank lines. Return false at the first malformed line.
+    static bool parseAscii(const Header& header, const char* begin, const char* end, std::vector<Vec3d>& points, std::vector<RGB>& colors);
+
+    bool readAscii(const MappedFile& file, const Header& header, const Vertex& vertex, TaskScheduler& scheduler);
+    bool readBinary(const MappedFile& file, const Header& header, const Vertex& vertex);
+    // Decode the vertices straight into the arrays of the cloud, in parallel.
+    bool readBinary(const MappedFile& file, const Header& header, PointCloud& cloud, TaskScheduler& scheduler);
+
+    bool writeAscii(std::ostream& out, PointCloud& cloud);
+    bool writeBinary(std::ostream& out, PointCloud& cloud);
+    template <typename T>
+    bool writeBinary(std::ostream& out, PointCloud& cloud);
+
+    // Whether the coordinates written are double rather than float.
+    bool mDoubleCoordinates;
 };
 
 #endif // PLY_H
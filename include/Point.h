@@ -2,9 +2,21 @@
 #define POINT_H
 
 #include "Vec3.h"
-#include <memory>
+#include <cstdint>
+#include <limits>
 
-typedef Vec3d Point;
-typedef std::shared_ptr<Point> SharedPoint;
+// Type of the coordinates of the points. Building with PLANE_DETECTION_FLOAT stores them
+// as float, which halves the memory of a cloud; planes keep their statistics in double.
+#ifdef PLANE_DETECTION_FLOAT
+typedef float Coordinate;
+#else
+typedef double Coordinate;
+#endif
+
+typedef Vec3<Coordinate> Point;
+
+// Index of a point in its PointCloud.
+typedef std::uint32_t PointIndex;
+const PointIndex InvalidPoint = std::numeric_limits<PointIndex>::max();
 
 #endif
@@ -7,10 +7,14 @@
 #include "Plane.h"
 #include "UnionFind.h"
 
-// Set of points.
+// Set of points, stored as one contiguous array per coordinate. Coordinates, bounding box
+// and the planes found in the cloud are relative to an origin, so that clouds far from zero,
+// such as georeferenced ones, keep their precision with float coordinates.
 class PointCloud
 {
     friend class Test;
+    friend class NormalEstimation;
+    friend class Ply;
 
 public:
     // Empty cloud.
@@ -19,29 +23,84 @@ public:
     // Merge two point clouds.
     void merge(const PointCloud& other);
 
+    // Origin for a cloud whose first point is p: p rounded to a multiple of 1024 on each
+    // axis, so that clouds around zero keep their coordinates.
+    static Vec3d originNear(const Vec3d& p);
+
     // Accessors.
+    inline Vec3d origin() const
+        {return mOrigin;}
     inline Vec3d center() const
         {return mCenter;}
     inline Vec3d halfDimension() const
         {return mHalfDimension;}
-    inline const std::vector<SharedPoint>& points() const
-        {return mPoints;}
+    inline Vec3d minimum() const
+        {return min;}
+    inline Vec3d maximum() const
+        {return max;}
+    inline std::size_t size() const
+        {return mX.size();}
+    inline Point point(PointIndex i) const
+        {return Point(mX[i], mY[i], mZ[i]);}
+    inline RGB color(PointIndex i) const
+        {return mRGB[i];}
+    inline const std::vector<Coordinate>& x() const
+        {return mX;}
+    inline const std::vector<Coordinate>& y() const
+        {return mY;}
+    inline const std::vector<Coordinate>& z() const
+        {return mZ;}
+    // Normals and curvatures estimated by NormalEstimation, for every point or none. Points
+    // added since then have none, and the others are then ignored too.
+    inline bool hasNormals() const
+        {return !mNormalX.empty() && mNormalX.size() == mX.size();}
+    inline const std::vector<float>& normalX() const
+        {return mNormalX;}
+    inline const std::vector<float>& normalY() const
+        {return mNormalY;}
+    inline const std::vector<float>& normalZ() const
+        {return mNormalZ;}
+    inline const std::vector<float>& curvature() const
+        {return mCurvature;}
     inline UnionFindPlanes& colors()
         {return mColors;}
+
+    // Set the origin of the coordinates, before adding points.
+    inline void setOrigin(const Vec3d& origin)
+        {mOrigin = origin;}
+    // Move an existing point.
+    inline void setPoint(PointIndex i, const Point& p)
+        {mX[i] = p.x; mY[i] = p.y; mZ[i] = p.z;}
+    // Project the points [begin, end) on the plane of unit normal: normal * X + d = 0.
+    void project(const PointIndex* begin, const PointIndex* end, const Vec3d& normal, double d);
     
-    // Add point.
-    void addPoint(SharedPoint p, RGB color);
+    // Reserve storage for n points.
+    void reserve(std::size_t n);
+    // Add point and return its index.
+    PointIndex addPoint(const Point& p, RGB color);
     
     // Compute bounding box.
     void boundingBox();
 
 private:
+    // Resize the coordinates and colors to n points, which are then written in place.
+    void resize(std::size_t n);
+    // Label the points from first on and add them to the bounding box, as addPoint does.
+    void appended(PointIndex first);
 
+    Vec3d mOrigin;
     Vec3d mCenter;
     Vec3d mHalfDimension;
     Vec3d min;
     Vec3d max;
-    std::vector<SharedPoint> mPoints;
+    std::vector<Coordinate> mX;
+    std::vector<Coordinate> mY;
+    std::vector<Coordinate> mZ;
+    std::vector<RGB> mRGB;
+    std::vector<float> mNormalX;
+    std::vector<float> mNormalY;
+    std::vector<float> mNormalZ;
+    std::vector<float> mCurvature;
     UnionFindPlanes mColors;
 };
 
@@ -1,19 +1,27 @@
 #ifndef RANSAC_H
 #define RANSAC_H
 
+#include "DetectionParams.h"
 #include "Plane.h"
+#include "PointCloud.h"
+#include <cstdint>
 #include <vector>
-#include <random>
+
+class TaskScheduler;
 
 class Ransac
 {
 public:
-    // Find a plane with RANSAC algorithm.
-    static SharedPlane ransac(std::vector<SharedPoint>& points, double epsilon, int numStartPoints, int numPoints, int steps, std::default_random_engine& generator, UnionFindPlanes& colors);
+    // Find a plane with RANSAC algorithm, and remove its points from points. Hypothesis t
+    // draws its sample from the Philox stream t of key, and hypotheses are scored in
+    // parallel batches for large sets of points. The result only depends on key.
+    // If the cloud has normals, samples grow from a flat seed with points whose normals agree
+    // with it, hypotheses whose plane disagrees with the seed are rejected before scoring, and
+    // inliers must agree with the plane as well.
+    static SharedPlane ransac(const PointCloud& cloud, std::vector<PointIndex>& points, const DetectionParams& params, std::uint64_t key, UnionFindPlanes& colors, TaskScheduler& scheduler);
 
-private:
-    // Match points close to the plane.
-    static void matchPoints(const std::vector<SharedPoint>& points, Plane& plane, double epsilon, std::vector<SharedPoint>& pts_int, std::vector<SharedPoint>& pts_out);
+    // Hypotheses needed to draw an all-inlier sample of sampleSize points with given probability, for a given inlier ratio.
+    static int requiredSteps(double inlierRatio, int sampleSize, double confidence, int maxSteps);
 };
 
 #endif
@@ -0,0 +1,81 @@
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads. Each worker has its own task queue and steals
+// from the others when it runs dry.
+class TaskScheduler
+{
+public:
+    typedef std::function<void()> Task;
+
+    // Set of tasks that can be waited for together.
+    class Group
+    {
+    public:
+        Group(TaskScheduler& scheduler);
+        // Wait for the remaining tasks.
+        ~Group();
+
+        Group(const Group&) = delete;
+        Group& operator=(const Group&) = delete;
+
+        // Schedule a task.
+        void run(Task task);
+        // Wait for all tasks, executing pending ones meanwhile. Rethrow the first exception raised by a task.
+        void wait();
+
+    private:
+        TaskScheduler& mScheduler;
+        std::atomic<int> mPending;
+        std::mutex mMutex;
+        std::exception_ptr mException;
+    };
+
+    // Use the given number of threads, counting the calling one. 0 means one per core.
+    explicit TaskScheduler(unsigned int threads = 0);
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    inline unsigned int threadCount() const
+        {return mThreads.size() + 1;}
+
+    // Run f(i) for i in [begin, end), in chunks of at least grain iterations.
+    void parallelFor(std::size_t begin, std::size_t end, std::size_t grain, const std::function<void(std::size_t, std::size_t)>& f);
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Push a task on the queue of the current thread.
+    void push(Task task);
+    // Run one pending task, own queue first. Return false if there was none.
+    bool runOne();
+    void worker(unsigned int index);
+    unsigned int currentQueue() const;
+
+    // One queue per worker, the last one is shared by outside threads.
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::atomic<int> mQueued;
+    bool mStop;
+};
+
+#endif // TASK_SCHEDULER_H
@@ -0,0 +1,98 @@
+#ifndef TILED_DETECTION_H
+#define TILED_DETECTION_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "Plane.h"
+#include "Ply.h"
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// Plane detection in clouds that do not fit in memory. The points are binned into
+// tiles stored on disk, planes are detected in one tile at a time and merged across
+// tile borders, then the points are projected and written tile by tile.
+class TiledDetection
+{
+public:
+    // Detect planes in the cloud of one tile.
+    typedef std::function<void(PointCloud& cloud, std::vector<SharedPlane>& planes)> Detector;
+
+    // Store tiles of at most maxPoints points in directory, which is created if needed.
+    TiledDetection(const std::string& directory, std::size_t maxPoints);
+    // Remove the tiles.
+    ~TiledDetection();
+
+    TiledDetection(const TiledDetection&) = delete;
+    TiledDetection& operator=(const TiledDetection&) = delete;
+
+    // Number of points whose detection fits in a memory budget, in bytes, with or without normals.
+    static std::size_t pointsForBudget(std::size_t bytes, bool linearOctree, bool normals);
+
+    // Bin the points of a PLY file into cubic tiles of the given size, in one pass. A size of 0
+    // is guessed from the first points. Tiles with too many points are then split in octants.
+    bool split(const std::string& filename, double tileSize = 0);
+    // Detect planes in each tile. Only their equations and statistics are kept.
+    bool detect(const Detector& detector);
+    // Merge the planes of neighbouring tiles, then remove those that are small compared to the
+    // largest one, as the root of the octree does for a single cloud.
+    void merge(double dCos, double countRatio);
+    // Project the points on the planes of at least minPoints points, as PlaneDetection::projectPoints,
+    // and write the cloud tile by tile.
+    bool write(const std::string& filename, Ply::Format format, unsigned int minPoints, TaskScheduler& scheduler);
+
+    inline std::size_t size() const
+        {return mSize;}
+    inline std::size_t tileCount() const
+        {return mTiles.size();}
+    // Planes found, after merge(). They are relative to origin().
+    inline std::vector<SharedPlane>& planes()
+        {return mPlanes;}
+    // Origin of the clouds of all tiles, near the first point of the file.
+    inline Vec3d origin() const
+        {return mOrigin;}
+
+private:
+    struct Tile
+    {
+        std::string filename;
+        std::size_t count;
+        // Cell covered by the tile, in absolute coordinates.
+        Vec3d low;
+        Vec3d high;
+        // Bounding box of its points.
+        Vec3d min;
+        Vec3d max;
+        unsigned int depth;
+        // Planes of the tile in mTilePlanes.
+        std::size_t firstPlane;
+        std::size_t planeCount;
+    };
+
+    std::size_t addTile(const Vec3d& low, const Vec3d& high, unsigned int depth);
+    // Buffer a point of a tile, writing buffers to disk when they are full.
+    bool append(std::size_t tile, const Vec3d& p, RGB color);
+    bool flush(std::size_t tile);
+    bool flushAll();
+    // Split a tile in octants until they are small enough.
+    bool splitTile(std::size_t tile);
+    bool readTile(const Tile& tile, PointCloud& cloud) const;
+    void removeTile(Tile& tile);
+
+    std::string mDirectory;
+    bool mCreated;
+    std::size_t mMaxPoints;
+    std::size_t mSize;
+    Vec3d mOrigin;
+    std::vector<Tile> mTiles;
+
+    // Records waiting to be appended to the file of each tile.
+    std::vector<std::vector<char>> mBuffers;
+    std::size_t mBuffered;
+
+    std::vector<SharedPlane> mTilePlanes;
+    std::vector<SharedPlane> mPlanes;
+};
+
+#endif // TILED_DETECTION_H
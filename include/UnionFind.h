@@ -3,6 +3,9 @@
 
 #include <memory>
 #include <map>
+#include <vector>
+#include <cstdint>
+#include <utility>
 #include "Point.h"
 #include "RGB.h"
 
@@ -98,7 +101,195 @@ private:
     std::shared_ptr<Cell> invalid;
 };
 
-typedef UnionFind<SharedPoint, std::pair<RGB, bool>> UnionFindPlanes;
+// Union-find container over dense integer keys, stored in flat arrays.
+// Operations on disjoint equivalency classes may run concurrently, as long
+// as no key is appended meanwhile.
+template <typename Value>
+class FlatUnionFind
+{
+public:
+    typedef std::uint32_t Key;
+
+    // Reserve storage for n keys.
+    void reserve(std::size_t n)
+    {
+        mParent.reserve(n);
+        mRank.reserve(n);
+        mStamp.reserve(n);
+        mLinkStamp.reserve(n);
+        mValue.reserve(n);
+        mInitial.reserve(n);
+    }
+
+    // Add a new key with specified value. Keys must be appended in order.
+    void append(Key key, const Value& value)
+    {
+        if (key >= mParent.size())
+        {
+            mParent.resize(key + 1);
+            mRank.resize(key + 1);
+            mStamp.resize(key + 1);
+            mLinkStamp.resize(key + 1);
+            mValue.resize(key + 1);
+            mInitial.resize(key + 1);
+        }
+        mParent[key] = key;
+        mRank[key] = 0;
+        mStamp[key] = 0;
+        mLinkStamp[key] = 0;
+        mValue[key] = value;
+        mInitial[key] = value;
+    }
+
+    // Add keys until there are n, each key k with value(k). Same as appending them one by one.
+    template <typename Function>
+    void extend(std::size_t n, const Function& value)
+    {
+        const std::size_t first = mParent.size();
+        mParent.resize(n);
+        mRank.resize(n);
+        mStamp.resize(n);
+        mLinkStamp.resize(n);
+        mValue.resize(n);
+        mInitial.resize(n);
+        for (std::size_t key = first ; key < n ; ++key)
+        {
+            mParent[key] = key;
+            mValue[key] = value(key);
+            mInitial[key] = mValue[key];
+        }
+    }
+
+    // Get value for equivalency class of key.
+    Value at(Key key) const
+    {
+        if (key >= mParent.size())
+            return Value();
+        return mValue[find(key)];
+    }
+
+    // Set value for equivalency class of key.
+    void set(Key key, const Value& value)
+    {
+        if (key < mParent.size())
+            mValue[find(key)] = value;
+    }
+
+    // Merge equivalency classes of k1 and k2. The class takes the value of k2.
+    void merge(Key k1, Key k2)
+    {
+        if (k1 >= mParent.size() || k2 >= mParent.size())
+            return;
+        Key root1 = find(k1);
+        Key root2 = find(k2);
+        if (root1 == root2)
+            return;
+
+        if (mRank[root1] > mRank[root2])
+        {
+            mValue[root1] = mValue[root2];
+            std::swap(root1, root2);
+        }
+        else if (mRank[root1] == mRank[root2])
+            ++mRank[root2];
+        mParent[root1] = root2;
+        mLinkStamp[root1] = mStamp[root2];
+    }
+
+    // Destroy equivalency class of key and reset each item to its initial value.
+    void reset(Key key)
+    {
+        if (key < mParent.size())
+            detach(find(key));
+    }
+
+private:
+    // Make c a singleton with its initial value. Links pointing to c become stale,
+    // so the other members detach themselves lazily the next time they are found.
+    void detach(Key c) const
+    {
+        mParent[c] = c;
+        mRank[c] = 0;
+        ++mStamp[c];
+        mValue[c] = mInitial[c];
+    }
+
+    // A link is valid if its target was not detached since the link was made.
+    bool linked(Key c) const
+    {
+        return mLinkStamp[c] == mStamp[mParent[c]];
+    }
+
+    // Root of the class of key, with path halving.
+    Key find(Key key) const
+    {
+        Key c = key;
+        while (mParent[c] != c)
+        {
+            if (!linked(c))
+            {
+                // The class of key was destroyed.
+                detach(key);
+                return key;
+            }
+            Key p = mParent[c];
+            if (mParent[p] != p && linked(p))
+            {
+                mParent[c] = mParent[p];
+                mLinkStamp[c] = mLinkStamp[p];
+            }
+            c = mParent[c];
+        }
+        return c;
+    }
+
+    mutable std::vector<Key> mParent;
+    mutable std::vector<unsigned char> mRank;
+    mutable std::vector<std::uint32_t> mStamp;
+    mutable std::vector<std::uint32_t> mLinkStamp;
+    mutable std::vector<Value> mValue;
+    std::vector<Value> mInitial;
+};
+
+// Labels of the points: the points of a plane form one equivalency class.
+// The points of each plane are also chained in a list through one array of
+// links, so that the lists of two planes are joined in constant time.
+class UnionFindPlanes : public FlatUnionFind<std::pair<RGB, bool>>
+{
+public:
+    // Reserve storage for n keys.
+    void reserve(std::size_t n)
+    {
+        FlatUnionFind::reserve(n);
+        mNext.reserve(n);
+    }
+
+    // Add a new key with specified value. Keys must be appended in order.
+    void append(Key key, const std::pair<RGB, bool>& value)
+    {
+        FlatUnionFind::append(key, value);
+        if (key >= mNext.size())
+            mNext.resize(key + 1);
+        mNext[key] = InvalidPoint;
+    }
+
+    // Add keys until there are n, each key k with value(k).
+    template <typename Function>
+    void extend(std::size_t n, const Function& value)
+    {
+        FlatUnionFind::extend(n, value);
+        mNext.resize(n, InvalidPoint);
+    }
+
+    // Point after key in the list of its plane, or InvalidPoint.
+    inline Key next(Key key) const
+        {return mNext[key];}
+    inline void setNext(Key key, Key next)
+        {mNext[key] = next;}
+
+private:
+    std::vector<Key> mNext;
+};
 
 #endif // UNION_FIND_H
 
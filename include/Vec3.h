@@ -1,7 +1,6 @@
 #ifndef Vec3_h_
 #define Vec3_h_
 
-#include "RGB.h"
 #include <cmath>
 
 // 3D-vector
@@ -14,14 +13,15 @@ struct Vec3 {
         };
         T D[3];
     };
-    RGB color;
 
     inline Vec3() :
         x(0), y(0), z(0) {}
     inline Vec3(T _x, T _y, T _z) :
         x(_x), y(_y), z(_z) {}
-    inline Vec3(T _x, T _y, T _z, RGB _color) :
-        x(_x), y(_y), z(_z), color(_color) {}
+    // Conversion from another precision.
+    template <typename U>
+    inline explicit Vec3(const Vec3<U>& v) :
+        x(T(v.x)), y(T(v.y)), z(T(v.z)) {}
 
     inline bool nonNull()
         {return x != 0 || y != 0 || z != 0;}
@@ -103,6 +103,7 @@ inline Vec3<T> operator*(T t, const Vec3<T>& v) {
     return Vec3<T>(v.x * t, v.y * t, v.z * t);
 }
 
+typedef Vec3<float> Vec3f;
 typedef Vec3<double> Vec3d;
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <vector>
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// Downsampling of a cloud on a grid of cubic voxels: the points of a voxel, duplicates
+// included, are replaced by one point at their mean position, with their mean color.
+class VoxelGrid
+{
+public:
+    // Fill reduced with one point per non-empty voxel of side size, in the order of the first
+    // point of each voxel and with the origin of cloud, and set mapping[i] to the point of reduced that replaces point i.
+    // Voxels are hashed in parallel; the result does not depend on the number of threads.
+    // The size is raised if needed so that there are at most 2^21 voxels along each axis.
+    static void downsample(const PointCloud& cloud, double size, PointCloud& reduced, std::vector<PointIndex>& mapping, TaskScheduler& scheduler);
+};
+
+#endif // VOXEL_GRID_H
@@ -0,0 +1,338 @@
+#include "DetectionCache.h"
+
+#include "MappedFile.h"
+#include "Philox.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+const char Magic[8] = {'P', 'L', 'N', 'C', 'A', 'C', 'H', 'E'};
+// Increase when the layout of the file or the results of the detection change.
+const std::uint32_t Version = 2;
+// Bytes of the input file hashed by one task.
+const std::size_t HashChunk = 1 << 22;
+
+// Beginning of the file. It is followed by the sections, all aligned on 8 bytes:
+// x, y, z and colors of the cloud, then those of the reduced cloud and the mapping
+// if downsampled, then one PlaneRecord per plane and the members of all planes.
+struct Header
+{
+    char magic[8];
+    std::uint32_t version;
+    // Size of the coordinates, which depends on the build.
+    std::uint32_t coordinateBytes;
+    std::uint32_t downsampled;
+    std::uint32_t padding;
+    std::uint64_t inputHash;
+    std::uint64_t paramsHash;
+    std::uint64_t points;
+    std::uint64_t reducedPoints;
+    std::uint64_t planes;
+    std::uint64_t members;
+    // Origin of the coordinates of both clouds and of the planes.
+    double origin[3];
+};
+
+struct PlaneRecord
+{
+    double normal[3];
+    double d;
+    double m[9];
+    double sum[3];
+    double center[3];
+    double radius;
+    double thickness;
+    std::uint32_t point;
+    std::uint32_t count;
+    std::uint64_t members;
+    unsigned char color[3];
+    unsigned char labeled;
+    std::uint32_t padding;
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(PlaneRecord) % 8 == 0, "Sections must stay aligned");
+
+inline std::size_t padded(std::size_t bytes)
+{
+    return (bytes + 7) / 8 * 8;
+}
+
+inline std::size_t cloudBytes(std::size_t n)
+{
+    return 3 * padded(n * sizeof(Coordinate)) + padded(3 * n);
+}
+
+inline std::uint64_t step(std::uint64_t h, std::uint64_t w)
+{
+    h ^= w * 0x9e3779b97f4a7c15ull;
+    return (h << 31 | h >> 33) * 0xbf58476d1ce4e5b9ull;
+}
+
+std::uint64_t hashBytes(const char* data, std::size_t size)
+{
+    std::uint64_t h = size;
+    std::size_t i = 0;
+    for ( ; i + 8 <= size ; i += 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h = step(h, w);
+    }
+    if (i < size)
+    {
+        std::uint64_t w = 0;
+        std::memcpy(&w, data + i, size - i);
+        h = step(h, w);
+    }
+    return mix64(h);
+}
+
+template <typename T>
+void writeArray(std::ostream& out, const T* data, std::size_t n)
+{
+    static const char zeros[8] = {};
+    out.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+    out.write(zeros, padded(n * sizeof(T)) - n * sizeof(T));
+}
+
+void writeCloud(std::ostream& out, const PointCloud& cloud)
+{
+    writeArray(out, cloud.x().data(), cloud.size());
+    writeArray(out, cloud.y().data(), cloud.size());
+    writeArray(out, cloud.z().data(), cloud.size());
+    std::vector<unsigned char> rgb(3 * cloud.size());
+    for (PointIndex i = 0 ; i < cloud.size() ; ++i)
+    {
+        RGB color = cloud.color(i);
+        rgb[3 * i] = color.r;
+        rgb[3 * i + 1] = color.g;
+        rgb[3 * i + 2] = color.b;
+    }
+    writeArray(out, rgb.data(), rgb.size());
+}
+
+// Read n points relative to origin from data into cloud, and return the end of their section.
+const char* readCloud(const char* data, std::size_t n, const Vec3d& origin, PointCloud& cloud)
+{
+    const std::size_t section = padded(n * sizeof(Coordinate));
+    const Coordinate* x = reinterpret_cast<const Coordinate*>(data);
+    const Coordinate* y = reinterpret_cast<const Coordinate*>(data + section);
+    const Coordinate* z = reinterpret_cast<const Coordinate*>(data + 2 * section);
+    const unsigned char* rgb = reinterpret_cast<const unsigned char*>(data + 3 * section);
+    cloud.setOrigin(origin);
+    cloud.reserve(n);
+    for (std::size_t i = 0 ; i < n ; ++i)
+        cloud.addPoint(Point(x[i], y[i], z[i]), RGB(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]));
+    if (n > 0)
+        cloud.boundingBox();
+    return data + cloudBytes(n);
+}
+
+}
+
+bool DetectionCache::hashFile(const std::string& filename, std::uint64_t& hash, TaskScheduler& scheduler)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return false;
+    }
+    std::vector<std::uint64_t> chunks((file.size() + HashChunk - 1) / HashChunk);
+    scheduler.parallelFor(0, chunks.size(), 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t c = begin ; c < end ; ++c)
+            chunks[c] = hashBytes(file.data() + c * HashChunk, std::min(HashChunk, file.size() - c * HashChunk));
+    });
+    hash = hashBytes(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(std::uint64_t));
+    return true;
+}
+
+std::uint64_t DetectionCache::hashParams(const DetectionParams& params)
+{
+    std::uint64_t hash = 0;
+    for (double value : {double(params.depthThreshold), params.epsilon, double(params.numStartPoints),
+                         double(params.numPoints), double(params.steps), params.countRatio, params.dCos,
+                         double(params.globalMerge), params.confidence, double(params.preemptiveSubset),
+                         params.preemptiveRatio, params.normalCos, params.maxCurvature})
+        hash = combine(hash, value);
+    return hash;
+}
+
+std::uint64_t DetectionCache::combine(std::uint64_t hash, double value)
+{
+    std::uint64_t w;
+    std::memcpy(&w, &value, sizeof(w));
+    return mix64(step(hash, w));
+}
+
+bool DetectionCache::write(const std::string& filename, std::uint64_t inputHash, std::uint64_t paramsHash,
+                           PointCloud& cloud, PointCloud& reduced, const std::vector<PointIndex>& mapping,
+                           const std::vector<SharedPlane>& planes)
+{
+    PointCloud& detected = mapping.empty() ? cloud : reduced;
+    std::vector<PlaneRecord> records;
+    std::vector<PointIndex> members;
+    for (const SharedPlane& plane : planes)
+    {
+        const Plane& p = *plane;
+        PlaneRecord record = {};
+        for (int a = 0 ; a < 3 ; ++a)
+        {
+            record.normal[a] = p.normal[a];
+            record.sum[a] = p.sum[a];
+            record.center[a] = p.center[a];
+            for (int b = 0 ; b < 3 ; ++b)
+                record.m[3 * a + b] = p.m(a, b);
+        }
+        record.d = p.d;
+        record.radius = p.radius;
+        record.thickness = p.thickness;
+        record.point = p.point;
+        record.count = p.count;
+        std::vector<PointIndex> pts = p.members(detected.colors());
+        record.members = pts.size();
+        members.insert(members.end(), pts.begin(), pts.end());
+        if (p.point != InvalidPoint)
+        {
+            std::pair<RGB, bool> label = detected.colors().at(p.point);
+            record.color[0] = label.first.r;
+            record.color[1] = label.first.g;
+            record.color[2] = label.first.b;
+            record.labeled = label.second;
+        }
+        records.push_back(record);
+    }
+
+    Header header = {};
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.coordinateBytes = sizeof(Coordinate);
+    header.downsampled = !mapping.empty();
+    header.inputHash = inputHash;
+    header.paramsHash = paramsHash;
+    header.points = cloud.size();
+    header.reducedPoints = mapping.empty() ? 0 : reduced.size();
+    header.planes = records.size();
+    header.members = members.size();
+    for (int a = 0 ; a < 3 ; ++a)
+        header.origin[a] = cloud.origin()[a];
+
+    // Written aside and renamed, so that an interrupted run never leaves a truncated cache.
+    std::string temporary = filename + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary);
+    writeArray(out, &header, 1);
+    writeCloud(out, cloud);
+    if (!mapping.empty())
+    {
+        writeCloud(out, reduced);
+        writeArray(out, mapping.data(), mapping.size());
+    }
+    writeArray(out, records.data(), records.size());
+    writeArray(out, members.data(), members.size());
+    out.close();
+    if (!out || std::rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "Cannot write " << filename << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DetectionCache::read(const std::string& filename, std::uint64_t inputHash, std::uint64_t paramsHash,
+                          PointCloud& cloud, PointCloud& reduced, std::vector<PointIndex>& mapping,
+                          std::vector<SharedPlane>& planes)
+{
+    MappedFile file;
+    if (!file.open(filename))
+        return false;
+
+    Header header;
+    if (file.size() < sizeof(Header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(Header));
+    if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 || header.version != Version || header.coordinateBytes != sizeof(Coordinate)
+        || header.inputHash != inputHash || header.paramsHash != paramsHash)
+        return false;
+
+    std::size_t expected = sizeof(Header) + cloudBytes(header.points) + header.planes * sizeof(PlaneRecord)
+                           + padded(header.members * sizeof(PointIndex));
+    if (header.downsampled)
+        expected += cloudBytes(header.reducedPoints) + padded(header.points * sizeof(PointIndex));
+    const std::size_t detectedPoints = header.downsampled ? header.reducedPoints : header.points;
+    if (file.size() != expected || header.members > detectedPoints)
+    {
+        std::cerr << "Invalid cache " << filename << std::endl;
+        return false;
+    }
+
+    const char* data = file.data() + sizeof(Header);
+    cloud = PointCloud();
+    reduced = PointCloud();
+    mapping.clear();
+    planes.clear();
+    const Vec3d origin(header.origin[0], header.origin[1], header.origin[2]);
+    data = readCloud(data, header.points, origin, cloud);
+    if (header.downsampled)
+    {
+        data = readCloud(data, header.reducedPoints, origin, reduced);
+        const PointIndex* map = reinterpret_cast<const PointIndex*>(data);
+        mapping.assign(map, map + header.points);
+        data += padded(header.points * sizeof(PointIndex));
+    }
+    const PlaneRecord* records = reinterpret_cast<const PlaneRecord*>(data);
+    const PointIndex* members = reinterpret_cast<const PointIndex*>(records + header.planes);
+
+    // Check all indices before labeling any point.
+    bool valid = true;
+    for (PointIndex i : mapping)
+        valid = valid && i < header.reducedPoints;
+    std::uint64_t total = 0;
+    for (std::size_t k = 0 ; k < header.planes ; ++k)
+    {
+        total += records[k].members;
+        valid = valid && (records[k].point < detectedPoints || records[k].point == InvalidPoint);
+    }
+    valid = valid && total == header.members;
+    for (std::size_t k = 0 ; valid && k < header.members ; ++k)
+        valid = members[k] < detectedPoints;
+    if (!valid)
+    {
+        std::cerr << "Invalid cache " << filename << std::endl;
+        cloud = PointCloud();
+        reduced = PointCloud();
+        mapping.clear();
+        return false;
+    }
+
+    UnionFindPlanes& colors = (header.downsampled ? reduced : cloud).colors();
+    for (std::size_t k = 0 ; k < header.planes ; ++k)
+    {
+        const PlaneRecord& record = records[k];
+        SharedPlane plane = std::make_shared<Plane>();
+        Plane& p = *plane;
+        for (int a = 0 ; a < 3 ; ++a)
+        {
+            p.normal[a] = record.normal[a];
+            p.sum[a] = record.sum[a];
+            p.center[a] = record.center[a];
+            for (int b = 0 ; b < 3 ; ++b)
+                p.m(a, b) = record.m[3 * a + b];
+        }
+        p.d = record.d;
+        p.radius = record.radius;
+        p.thickness = record.thickness;
+        p.point = record.point;
+        p.count = record.count;
+        p.setMembers(std::vector<PointIndex>(members, members + record.members), colors);
+        members += record.members;
+        if (record.labeled)
+            p.setColor(RGB(record.color[0], record.color[1], record.color[2]), colors);
+        planes.push_back(plane);
+    }
+    return true;
+}
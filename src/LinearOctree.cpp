@@ -0,0 +1,214 @@
+#include "LinearOctree.h"
+
+#include "Metrics.h"
+#include "PlaneDetection.h"
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+// Spread the 21 low bits of v so that they occupy every third bit.
+inline std::uint64_t expandBits(std::uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Octant of a code at given depth, with the same numbering as Octree (x = 4, y = 2, z = 1).
+inline int octant(std::uint64_t code, unsigned int depth)
+{
+    return (code >> (3 * (LinearOctree::MaxDepth - 1 - depth))) & 7;
+}
+
+}
+
+LinearOctree::LinearOctree(const PointCloud& cloud, unsigned int leafCapacity, TaskScheduler& scheduler, unsigned int maxdepth) :
+    mCloud(cloud), mPoints(cloud.size())
+{
+    std::vector<std::uint64_t> codes;
+    computeCodes(cloud, codes, scheduler);
+    for (PointIndex i = 0 ; i < mPoints.size() ; ++i)
+        mPoints[i] = i;
+    sortByCode(codes, mPoints, scheduler);
+
+    Node root = {0, std::uint32_t(mPoints.size()), 0, 0};
+    mNodes.push_back(root);
+    build(0, codes, 0, std::min(maxdepth, MaxDepth), std::max(1u, leafCapacity));
+}
+
+void LinearOctree::build(std::uint32_t node, const std::vector<std::uint64_t>& codes, unsigned int depth, unsigned int maxdepth, unsigned int leafCapacity)
+{
+    std::uint32_t begin = mNodes[node].begin;
+    std::uint32_t end = mNodes[node].end;
+    if (end - begin <= leafCapacity || depth >= maxdepth)
+        return;
+
+    // Split the range by octant, codes are sorted so each octant is a contiguous run.
+    std::uint32_t bounds[9];
+    bounds[0] = begin;
+    for (int o = 0 ; o < 8 ; ++o)
+        bounds[o + 1] = std::partition_point(codes.begin() + bounds[o], codes.begin() + end,
+                                             [&](std::uint64_t c) {return octant(c, depth) <= o;}) - codes.begin();
+
+    std::uint32_t first = mNodes.size();
+    std::uint8_t mask = 0;
+    for (int o = 0 ; o < 8 ; ++o)
+    {
+        if (bounds[o + 1] > bounds[o])
+        {
+            Node child = {bounds[o], bounds[o + 1], 0, 0};
+            mNodes.push_back(child);
+            mask |= 1 << o;
+        }
+    }
+    mNodes[node].firstChild = first;
+    mNodes[node].childMask = mask;
+
+    for (std::uint32_t c = first ; c < first + __builtin_popcount(mask) ; ++c)
+        build(c, codes, depth + 1, maxdepth, leafCapacity);
+}
+
+void LinearOctree::detectPlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const
+{
+    detectPlanes(0, 0, params, generator(), planes, colors, scheduler);
+    if (params.globalMerge)
+        PlaneDetection::mergeAll(planes, params.dCos, colors);
+}
+
+void LinearOctree::detectPlanes(std::uint32_t node, unsigned int depth, const DetectionParams& params, std::uint32_t seed, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const
+{
+    const Node& n = mNodes[node];
+    const PointIndex* begin = mPoints.data() + n.begin;
+    const PointIndex* end = mPoints.data() + n.end;
+
+    if (n.end - n.begin > std::uint32_t(params.depthThreshold) && n.childMask)
+    {
+        std::vector<SharedPlane> child_plns[8];
+        {
+            TaskScheduler::Group group(scheduler);
+            std::uint32_t child = n.firstChild;
+            for (int o = 0 ; o < 8 ; ++o)
+            {
+                if (!(n.childMask & (1 << o)))
+                    continue;
+                auto task = [&, child, o]() {
+                    detectPlanes(child, depth + 1, params, PlaneDetection::childSeed(seed, o), child_plns[o], colors, scheduler);
+                };
+                // Leaves are too small to be worth a task.
+                if (mNodes[child].end - mNodes[child].begin > std::uint32_t(params.depthThreshold))
+                    group.run(task);
+                else
+                    task();
+                ++child;
+            }
+            group.wait();
+        }
+
+        Metrics::Timer timer(depth);
+        std::vector<SharedPlane> plns;
+        for (int o = 0 ; o < 8 ; ++o)
+            plns.insert(plns.end(), child_plns[o].begin(), child_plns[o].end());
+
+        PlaneDetection::mergeChildren(mCloud, plns, begin, end, params, colors, planes);
+    }
+    else
+    {
+        Metrics::Timer timer(depth);
+        PlaneDetection::detectInLeaf(mCloud, begin, end, params, seed, planes, colors, scheduler);
+    }
+}
+
+void LinearOctree::computeCodes(const PointCloud& cloud, std::vector<std::uint64_t>& codes, TaskScheduler& scheduler)
+{
+    codes.resize(cloud.size());
+
+    const double cells = 1 << MaxDepth;
+    Vec3d min = cloud.minimum();
+    Vec3d extent = cloud.maximum() - min;
+    Vec3d scale;
+    for (int a = 0 ; a < 3 ; ++a)
+        scale[a] = extent[a] > 0 ? cells / extent[a] : 0;
+
+    const Coordinate* x = cloud.x().data();
+    const Coordinate* y = cloud.y().data();
+    const Coordinate* z = cloud.z().data();
+    auto quantize = [cells](double v) -> std::uint64_t {
+        return v <= 0 ? 0 : v >= cells - 1 ? std::uint64_t(cells - 1) : std::uint64_t(v);
+    };
+
+    scheduler.parallelFor(0, codes.size(), 1 << 14, [&](std::size_t b, std::size_t e) {
+        for (std::size_t i = b ; i < e ; ++i)
+            codes[i] = expandBits(quantize((x[i] - min.x) * scale.x)) << 2
+                     | expandBits(quantize((y[i] - min.y) * scale.y)) << 1
+                     | expandBits(quantize((z[i] - min.z) * scale.z));
+    });
+}
+
+void LinearOctree::sortByCode(std::vector<std::uint64_t>& codes, std::vector<PointIndex>& points, TaskScheduler& scheduler)
+{
+    const std::size_t n = codes.size();
+    const std::size_t chunks = std::max<std::size_t>(1, std::min<std::size_t>(4 * scheduler.threadCount(), n >> 16));
+    const std::size_t chunkSize = (n + chunks - 1) / chunks;
+
+    std::vector<std::uint64_t> codesTmp(n);
+    std::vector<PointIndex> pointsTmp(n);
+    std::vector<std::size_t> offsets(chunks * 256);
+
+    // Run f(chunk, begin, end) on every chunk in parallel.
+    auto forChunks = [&](const std::function<void(std::size_t, std::size_t, std::size_t)>& f) {
+        TaskScheduler::Group group(scheduler);
+        for (std::size_t c = 0 ; c < chunks ; ++c)
+        {
+            std::size_t b = std::min(n, c * chunkSize);
+            std::size_t e = std::min(n, b + chunkSize);
+            group.run([&f, c, b, e]() {f(c, b, e);});
+        }
+        group.wait();
+    };
+
+    for (unsigned int shift = 0 ; shift < 3 * MaxDepth ; shift += 8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        forChunks([&](std::size_t c, std::size_t b, std::size_t e) {
+            std::size_t* histogram = &offsets[c * 256];
+            for (std::size_t i = b ; i < e ; ++i)
+                ++histogram[(codes[i] >> shift) & 0xff];
+        });
+
+        // Exclusive prefix sum, digit-major so that the sort is stable.
+        std::size_t total = 0;
+        bool trivial = false;
+        for (unsigned int d = 0 ; d < 256 ; ++d)
+        {
+            std::size_t digitCount = 0;
+            for (std::size_t c = 0 ; c < chunks ; ++c)
+            {
+                std::size_t count = offsets[c * 256 + d];
+                offsets[c * 256 + d] = total;
+                total += count;
+                digitCount += count;
+            }
+            trivial = trivial || digitCount == n;
+        }
+        // Every code has the same digit, the pass would not move anything.
+        if (trivial)
+            continue;
+
+        forChunks([&](std::size_t c, std::size_t b, std::size_t e) {
+            std::size_t* offset = &offsets[c * 256];
+            for (std::size_t i = b ; i < e ; ++i)
+            {
+                std::size_t j = offset[(codes[i] >> shift) & 0xff]++;
+                codesTmp[j] = codes[i];
+                pointsTmp[j] = points[i];
+            }
+        });
+        codes.swap(codesTmp);
+        points.swap(pointsTmp);
+    }
+}
@@ -0,0 +1,66 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() :
+    mFd(-1), mData(nullptr), mSize(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    this->close();
+}
+
+bool MappedFile::open(const std::string& filename)
+{
+    this->close();
+
+    mFd = ::open(filename.c_str(), O_RDONLY);
+    if (mFd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(mFd, &st) != 0)
+    {
+        this->close();
+        return false;
+    }
+
+    mSize = st.st_size;
+    if (mSize == 0)
+        return true;
+
+    void* data = ::mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (data == MAP_FAILED)
+    {
+        this->close();
+        return false;
+    }
+    ::madvise(data, mSize, MADV_SEQUENTIAL);
+    mData = static_cast<const char*>(data);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mData)
+        ::munmap(const_cast<char*>(mData), mSize);
+    if (mFd >= 0)
+        ::close(mFd);
+    mFd = -1;
+    mData = nullptr;
+    mSize = 0;
+}
+
+void MappedFile::release(std::size_t offset) const
+{
+    const std::size_t page = ::sysconf(_SC_PAGESIZE);
+    offset = std::min(offset, mSize) / page * page;
+    if (mData && offset)
+        ::madvise(const_cast<char*>(mData), offset, MADV_DONTNEED);
+}
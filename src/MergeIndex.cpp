@@ -0,0 +1,106 @@
+#include "MergeIndex.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Cells of the normals along each axis, at most.
+const int MaxCells = 64;
+// Relative margin against rounding.
+const double Margin = 1e-9;
+
+}
+
+MergeIndex::MergeIndex(const std::vector<SharedPlane>& planes, double dCos) :
+    mPlanes(planes), mReach(0), mMaxThickness(0)
+{
+    // Two unit normals whose angle has a cosine of dCos are this far apart.
+    mChord = std::sqrt(std::max(0.0, 2 - 2 * dCos)) * (1 + Margin) + Margin;
+    mCells = std::max(1, std::min(MaxCells, int(std::ceil(2 / mChord))));
+    mCellSize = 2.0 / mCells;
+
+    std::size_t count = 0;
+    double thickness = 0;
+    for (const SharedPlane& p : planes)
+    {
+        if (!p)
+            continue;
+        mOrigin += p->getCenter();
+        thickness = std::max(thickness, p->getThickness());
+        ++count;
+    }
+    if (count)
+        mOrigin /= count;
+    for (const SharedPlane& p : planes)
+        if (p)
+            mReach = std::max(mReach, mOrigin.distance(p->getCenter()));
+
+    // Offsets of mergeable planes differ by about this much, see candidates.
+    mOffsetSize = mChord * mReach + thickness;
+    if (!(mOffsetSize > 0))
+        mOffsetSize = 1;
+}
+
+void MergeIndex::insert(std::uint32_t i)
+{
+    const Plane& p = *mPlanes[i];
+    double offset = p.normal * (p.getCenter() - mOrigin);
+    std::int64_t e = std::int64_t(std::floor(offset / mOffsetSize));
+    mBins[key(normalCell(p.normal.x), normalCell(p.normal.y), normalCell(p.normal.z), e)].push_back(i);
+    mMaxThickness = std::max(mMaxThickness, p.getThickness());
+}
+
+void MergeIndex::candidates(const Plane& p, std::vector<std::uint32_t>& indices) const
+{
+    indices.clear();
+    if (mBins.empty())
+        return;
+
+    // Mergeable planes have normals n and m with |n - m| or |n + m| below mChord, and one
+    // of their centers within the thickness of the other plane. With offsets taken from
+    // mOrigin, their offsets then differ by at most the larger thickness plus mChord times
+    // the distance between a center and mOrigin.
+    double reach = std::max(mReach, mOrigin.distance(p.getCenter()));
+    double slack = (std::max(p.getThickness(), mMaxThickness) + mChord * reach) * (1 + Margin) + Margin;
+    double offset = p.normal * (p.getCenter() - mOrigin);
+
+    for (int sign = -1 ; sign <= 1 ; sign += 2)
+    {
+        Vec3d n = p.normal * sign;
+        int first[3];
+        int last[3];
+        for (int a = 0 ; a < 3 ; ++a)
+        {
+            first[a] = normalCell(n[a] - mChord);
+            last[a] = normalCell(n[a] + mChord);
+        }
+        std::int64_t firstOffset = std::int64_t(std::floor((sign * offset - slack) / mOffsetSize));
+        std::int64_t lastOffset = std::int64_t(std::floor((sign * offset + slack) / mOffsetSize));
+
+        for (int x = first[0] ; x <= last[0] ; ++x)
+            for (int y = first[1] ; y <= last[1] ; ++y)
+                for (int z = first[2] ; z <= last[2] ; ++z)
+                    for (std::int64_t e = firstOffset ; e <= lastOffset ; ++e)
+                    {
+                        auto found = mBins.find(key(x, y, z, e));
+                        if (found != mBins.end())
+                            indices.insert(indices.end(), found->second.begin(), found->second.end());
+                    }
+    }
+
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+}
+
+int MergeIndex::normalCell(double n) const
+{
+    return std::max(0, std::min(mCells - 1, int(std::floor((n + 1) / mCellSize))));
+}
+
+std::int64_t MergeIndex::key(int x, int y, int z, std::int64_t e) const
+{
+    // Fewer than 2^18 normal cells.
+    std::uint64_t cell = (std::uint64_t(x) * mCells + y) * mCells + z;
+    return std::int64_t(std::uint64_t(e) << 18 | cell);
+}
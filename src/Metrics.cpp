@@ -0,0 +1,177 @@
+#include "Metrics.h"
+
+#include "PlaneKernels.h"
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+
+namespace {
+
+std::atomic<std::uint64_t> counters[Metrics::CounterCount];
+std::atomic<std::uint64_t> depthNanoseconds[Metrics::MaxDepth + 1];
+std::atomic<std::uint64_t> depthNodes[Metrics::MaxDepth + 1];
+
+// Stages and values, in insertion order.
+std::mutex mutex;
+std::vector<std::pair<std::string, double>> stages;
+std::vector<std::pair<std::string, double>> values;
+
+void accumulate(std::vector<std::pair<std::string, double>>& entries, const std::string& name, double value, bool replace)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto&& entry : entries)
+    {
+        if (entry.first == name)
+        {
+            entry.second = replace ? value : entry.second + value;
+            return;
+        }
+    }
+    entries.emplace_back(name, value);
+}
+
+void writeEntries(std::ostream& out, const std::vector<std::pair<std::string, double>>& entries)
+{
+    out << "{";
+    for (std::size_t i = 0 ; i < entries.size() ; ++i)
+        out << (i ? ", " : "") << "\"" << entries[i].first << "\": " << entries[i].second;
+    out << "}";
+}
+
+}
+
+Metrics::Timer::Timer(const char* stage) :
+    mStage(stage), mDepth(0), mRunning(true), mStart(std::chrono::steady_clock::now())
+{
+}
+
+Metrics::Timer::Timer(unsigned int depth) :
+    mStage(nullptr), mDepth(depth), mRunning(true), mStart(std::chrono::steady_clock::now())
+{
+}
+
+Metrics::Timer::~Timer()
+{
+    this->stop();
+}
+
+void Metrics::Timer::stop()
+{
+    if (!mRunning)
+        return;
+    mRunning = false;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+    if (mStage)
+        addTime(mStage, seconds);
+    else
+        addNode(mDepth, seconds);
+}
+
+void Metrics::add(Counter counter, std::uint64_t n)
+{
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Metrics::addTime(const std::string& stage, double seconds)
+{
+    accumulate(stages, stage, seconds, false);
+}
+
+void Metrics::addNode(unsigned int depth, double seconds)
+{
+    if (depth > MaxDepth)
+        depth = MaxDepth;
+    depthNanoseconds[depth].fetch_add(std::uint64_t(seconds * 1e9), std::memory_order_relaxed);
+    depthNodes[depth].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::setValue(const std::string& name, double value)
+{
+    accumulate(values, name, value, true);
+}
+
+void Metrics::reset()
+{
+    for (auto&& c : counters)
+        c = 0;
+    for (unsigned int i = 0 ; i <= MaxDepth ; ++i)
+    {
+        depthNanoseconds[i] = 0;
+        depthNodes[i] = 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    stages.clear();
+    values.clear();
+}
+
+std::uint64_t Metrics::counter(Counter counter)
+{
+    return counters[counter].load();
+}
+
+const char* Metrics::counterName(Counter counter)
+{
+    switch (counter)
+    {
+    case HypothesesTried: return "hypotheses_tried";
+    case HypothesesPreempted: return "hypotheses_preempted";
+    case HypothesesRejected: return "hypotheses_rejected";
+    case HypothesesAccepted: return "hypotheses_accepted";
+    case MergesAttempted: return "merges_attempted";
+    case MergesPerformed: return "merges_performed";
+    case PlanesRemoved: return "planes_removed";
+    case PointsReassigned: return "points_reassigned";
+    case PointsAccepted: return "points_accepted";
+    default: return "unknown";
+    }
+}
+
+std::size_t Metrics::peakMemory()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return std::size_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+bool Metrics::writeJson(const std::string& filename)
+{
+    std::ofstream out(filename.c_str());
+    if (!out)
+    {
+        std::cerr << "Cannot write " << filename << std::endl;
+        return false;
+    }
+
+    out << "{\n  \"isa\": \"" << PlaneKernels::isaName(PlaneKernels::isa()) << "\",\n";
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "  \"values\": ";
+        writeEntries(out, values);
+        out << ",\n  \"stages\": ";
+        writeEntries(out, stages);
+    }
+
+    out << ",\n  \"counters\": {";
+    for (int c = 0 ; c < CounterCount ; ++c)
+        out << (c ? ", " : "") << "\"" << counterName(Counter(c)) << "\": " << counters[c].load();
+    out << "},\n  \"depths\": [";
+
+    // Levels up to the deepest one that was reached.
+    int depths = MaxDepth + 1;
+    while (depths > 0 && depthNodes[depths - 1] == 0)
+        --depths;
+    for (int i = 0 ; i < depths ; ++i)
+        out << (i ? ", " : "") << "{\"depth\": " << i << ", \"nodes\": " << depthNodes[i].load()
+            << ", \"seconds\": " << depthNanoseconds[i].load() * 1e-9 << "}";
+    out << "],\n  \"peak_memory_bytes\": " << peakMemory() << "\n}\n";
+    return bool(out);
+}
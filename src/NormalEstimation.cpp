@@ -0,0 +1,215 @@
+#include "NormalEstimation.h"
+
+#include "Mat3.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+namespace {
+
+// Leaves of the k-d tree hold at most this many points.
+const std::size_t LeafSize = 16;
+// Smaller subtrees are built by the task of their parent.
+const std::size_t MinParallelPoints = 1 << 14;
+// Points queried together by a task, in tree order so that their neighbours are close in memory.
+const std::size_t QueryGrain = 1 << 12;
+
+// Balanced k-d tree over the points of a cloud, stored implicitly: node 1 holds the points
+// [0, n) of the tree order, and node i holding [begin, end) has children 2i with
+// [begin, middle) and 2i + 1 with [middle, end), split at the coordinate of point middle
+// along its widest axis.
+class KdTree
+{
+public:
+    KdTree(const PointCloud& cloud, TaskScheduler& scheduler) :
+        mCloud(cloud), mDepth(0)
+    {
+        const std::size_t n = cloud.size();
+        while (((n - 1) >> mDepth) >= LeafSize)
+            ++mDepth;
+        mAxis.resize(std::size_t(1) << mDepth);
+        mSplit.resize(std::size_t(1) << mDepth);
+        mOrder.resize(n);
+        for (std::size_t i = 0 ; i < n ; ++i)
+            mOrder[i] = i;
+        this->build(1, 0, n, 0, scheduler);
+
+        // Coordinates in tree order, so that leaves are contiguous.
+        mX.resize(n);
+        mY.resize(n);
+        mZ.resize(n);
+        scheduler.parallelFor(0, n, 1 << 14, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t k = begin ; k < end ; ++k)
+            {
+                mX[k] = cloud.x()[mOrder[k]];
+                mY[k] = cloud.y()[mOrder[k]];
+                mZ[k] = cloud.z()[mOrder[k]];
+            }
+        });
+    }
+
+    inline std::size_t size() const
+        {return mOrder.size();}
+    // Index in the cloud of the k-th point of the tree order.
+    inline PointIndex index(std::size_t k) const
+        {return mOrder[k];}
+    inline Vec3d point(std::size_t k) const
+        {return Vec3d(mX[k], mY[k], mZ[k]);}
+
+    // Replace neighbours by the k nearest points to q, as (squared distance, tree position)
+    // pairs in increasing order. Ties are broken by tree position.
+    void nearest(const Vec3d& q, std::size_t k, std::vector<std::pair<double, std::uint32_t>>& neighbours) const
+    {
+        neighbours.clear();
+        Vec3d offsets;
+        this->search(1, 0, this->size(), 0, q, 0, offsets, k, neighbours);
+    }
+
+private:
+    void build(std::size_t node, std::size_t begin, std::size_t end, unsigned int depth, TaskScheduler& scheduler)
+    {
+        if (depth == mDepth)
+            return;
+
+        Vec3d min(mCloud.point(mOrder[begin])), max = min;
+        for (std::size_t k = begin + 1 ; k < end ; ++k)
+        {
+            Vec3d p(mCloud.point(mOrder[k]));
+            min.min(p);
+            max.max(p);
+        }
+        Vec3d extent = max - min;
+        int axis = extent.x >= extent.y ? (extent.x >= extent.z ? 0 : 2) : (extent.y >= extent.z ? 1 : 2);
+        const std::vector<Coordinate>& c = axis == 0 ? mCloud.x() : axis == 1 ? mCloud.y() : mCloud.z();
+
+        const std::size_t middle = begin + (end - begin) / 2;
+        std::nth_element(mOrder.begin() + begin, mOrder.begin() + middle, mOrder.begin() + end, [&](PointIndex a, PointIndex b) {
+            return c[a] < c[b] || (c[a] == c[b] && a < b);
+        });
+        mAxis[node] = axis;
+        mSplit[node] = c[mOrder[middle]];
+
+        if (end - begin >= MinParallelPoints)
+        {
+            TaskScheduler::Group group(scheduler);
+            group.run([=, &scheduler]() {this->build(2 * node, begin, middle, depth + 1, scheduler);});
+            this->build(2 * node + 1, middle, end, depth + 1, scheduler);
+            group.wait();
+        }
+        else
+        {
+            this->build(2 * node, begin, middle, depth + 1, scheduler);
+            this->build(2 * node + 1, middle, end, depth + 1, scheduler);
+        }
+    }
+
+    // distance is the squared distance from q to the cell of node, and offsets its components
+    // along each axis, from the splits crossed to reach it.
+    void search(std::size_t node, std::size_t begin, std::size_t end, unsigned int depth, const Vec3d& q, double distance, Vec3d& offsets, std::size_t k, std::vector<std::pair<double, std::uint32_t>>& nearest) const
+    {
+        if (depth == mDepth)
+        {
+            for (std::size_t j = begin ; j < end ; ++j)
+            {
+                const double dx = mX[j] - q.x, dy = mY[j] - q.y, dz = mZ[j] - q.z;
+                const std::pair<double, std::uint32_t> candidate(dx * dx + dy * dy + dz * dz, std::uint32_t(j));
+                if (nearest.size() == k && !(candidate < nearest.back()))
+                    continue;
+                // Insertion in the sorted list, dropping the farthest point if it is full.
+                std::size_t slot = nearest.size();
+                if (slot < k)
+                    nearest.push_back(candidate);
+                else
+                    --slot;
+                for ( ; slot > 0 && candidate < nearest[slot - 1] ; --slot)
+                    nearest[slot] = nearest[slot - 1];
+                nearest[slot] = candidate;
+            }
+            return;
+        }
+
+        const std::size_t middle = begin + (end - begin) / 2;
+        const int axis = mAxis[node];
+        const double offset = q[axis] - mSplit[node];
+        const std::size_t nearNode = offset < 0 ? 2 * node : 2 * node + 1;
+        const std::size_t farNode = offset < 0 ? 2 * node + 1 : 2 * node;
+        // Nearest side first; the other one only if it may hold closer points, ties included.
+        if (offset < 0)
+            this->search(nearNode, begin, middle, depth + 1, q, distance, offsets, k, nearest);
+        else
+            this->search(nearNode, middle, end, depth + 1, q, distance, offsets, k, nearest);
+
+        const double previous = offsets[axis];
+        const double farDistance = distance - previous * previous + offset * offset;
+        if (nearest.size() < k || farDistance <= nearest.back().first)
+        {
+            offsets[axis] = offset;
+            if (offset < 0)
+                this->search(farNode, middle, end, depth + 1, q, farDistance, offsets, k, nearest);
+            else
+                this->search(farNode, begin, middle, depth + 1, q, farDistance, offsets, k, nearest);
+            offsets[axis] = previous;
+        }
+    }
+
+    const PointCloud& mCloud;
+    unsigned int mDepth;
+    std::vector<unsigned char> mAxis;
+    std::vector<double> mSplit;
+    std::vector<PointIndex> mOrder;
+    std::vector<Coordinate> mX;
+    std::vector<Coordinate> mY;
+    std::vector<Coordinate> mZ;
+};
+
+}
+
+void NormalEstimation::estimate(PointCloud& cloud, unsigned int k, TaskScheduler& scheduler)
+{
+    const std::size_t n = cloud.size();
+    cloud.mNormalX.assign(n, 0);
+    cloud.mNormalY.assign(n, 0);
+    cloud.mNormalZ.assign(n, 0);
+    cloud.mCurvature.assign(n, 0);
+    if (n == 0)
+        return;
+
+    KdTree tree(cloud, scheduler);
+    scheduler.parallelFor(0, n, QueryGrain, [&](std::size_t begin, std::size_t end) {
+        std::vector<std::pair<double, std::uint32_t>> neighbours;
+        neighbours.reserve(k);
+        for (std::size_t j = begin ; j < end ; ++j)
+        {
+            tree.nearest(tree.point(j), k, neighbours);
+
+            // Covariance around the mean of the neighbours.
+            Vec3d mean;
+            for (const auto& neighbour : neighbours)
+                mean += tree.point(neighbour.second);
+            mean /= neighbours.size();
+            Mat3d covariance;
+            for (const auto& neighbour : neighbours)
+            {
+                Vec3d diff = tree.point(neighbour.second) - mean;
+                covariance += Mat3d::outer(diff, diff);
+            }
+
+            Vec3d eigenvals;
+            Mat3d eigenvects;
+            covariance.eigenSymmetric(eigenvals, eigenvects);
+            const PointIndex i = tree.index(j);
+            double total = eigenvals.x + eigenvals.y + eigenvals.z;
+            if (total > 0)
+            {
+                Vec3d normal(eigenvects(2, 0), eigenvects(2, 1), eigenvects(2, 2));
+                normal.normalize();
+                cloud.mNormalX[i] = normal.x;
+                cloud.mNormalY[i] = normal.y;
+                cloud.mNormalZ[i] = normal.z;
+                cloud.mCurvature[i] = std::max(0.0, eigenvals.z) / total;
+            }
+            else
+                cloud.mCurvature[i] = 1.0 / 3;
+        }
+    });
+}
@@ -1,141 +1,286 @@
 #include "Octree.h"
 
-#include "Ransac.h"
+#include "Metrics.h"
+#include "PlaneDetection.h"
+#include "PlaneIndex.h"
 #include <algorithm>
 
-Octree::Octree(const PointCloud& cloud, unsigned int maxdepth) :
-    mRoot(cloud.center(), cloud.halfDimension())
-{
-    for (auto&& p : cloud.points())
-        mRoot.insert(p, maxdepth);
+namespace {
+
+const std::uint32_t NoPlane = std::uint32_t(-1);
+
 }
 
-void Octree::detectPlanes(int depthThreshold, double epsilon, int numStartPoints, int numPoints, int steps, double countRatio, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, double dCos) const
+Octree::Octree(const PointCloud& cloud, unsigned int maxdepth) :
+    mCloud(cloud), mMaxDepth(maxdepth), mRoot(cloud.center(), cloud.halfDimension())
 {
-    std::vector<SharedPoint> pts;
-    mRoot.detectPlanes(depthThreshold, epsilon, numStartPoints, numPoints, steps, countRatio, generator, planes, colors, dCos, pts);
+    for (PointIndex i = 0 ; i < cloud.size() ; ++i)
+        mRoot.insert(cloud, i, maxdepth);
+    mRoot.clearDirty();
 }
 
-Octree::Node::Node(const Vec3d& center, const Vec3d& halfSize) :
-    center(center), halfSize(halfSize), count(0)
+void Octree::insert(PointIndex begin, PointIndex end)
 {
+    for (PointIndex i = begin ; i < end ; ++i)
+        mRoot.insert(mCloud, i, mMaxDepth);
 }
 
-void Octree::Node::getPoints(std::vector<SharedPoint>& pts) const
+void Octree::updatePlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler)
 {
-    if (isLeafNode())
+    if (mOwner.empty())
     {
-        if (point.get() != nullptr)
-            pts.push_back(point);
+        mOwner.assign(mCloud.size(), NoPlane);
+        for (SharedPlane& plane : planes)
+        {
+            if (!plane)
+                continue;
+            std::uint32_t id = mPlanes.size();
+            for (PointIndex i : plane->members(colors))
+                mOwner[i] = id;
+            plane->clearMembers();
+            mPlanes.push_back(plane);
+            mGroups.append(id, id);
+        }
     }
-    else
-        for (auto&& child : children)
-            child->getPoints(pts);
-}
+    mOwner.resize(mCloud.size(), NoPlane);
 
-void Octree::Node::removeSmallPlanes(std::vector<SharedPlane>& planes, double countRatio, UnionFind<SharedPoint, std::pair<RGB, bool>>& colors)
-{
-    if (!planes.empty())
-    {
-        static auto comp = [](const SharedPlane& a, const SharedPlane& b){return a && b ? a->getCount() > b->getCount() : (bool)a;};
-        std::sort(planes.begin(), planes.end(), comp);
+    std::vector<std::pair<const Node*, unsigned int>> subtrees;
+    mRoot.collectDirty(params.updateRegion, 0, subtrees);
 
-        if (planes[0])
+    // Take the points of the dirty subtrees out of their planes, and make them unlabeled
+    // singletons again. The labels of the other points are no longer used.
+    std::vector<std::vector<PointIndex>> points(subtrees.size());
+    std::vector<std::uint32_t> changed;
+    for (std::size_t s = 0 ; s < subtrees.size() ; ++s)
+    {
+        subtrees[s].first->getPoints(points[s]);
+        for (PointIndex p : points[s])
         {
-            double minCount = planes[0]->getCount() * countRatio;
-            for (SharedPlane& p : planes)
+            colors.append(p, std::make_pair(mCloud.color(p), false));
+            std::uint32_t id = this->owner(p);
+            if (id != NoPlane)
             {
-                if (p && p->getCount() <= minCount)
-                {
-                    p->destroy(colors);
-                    p.reset();
-                }
+                mPlanes[id]->removePoint(mCloud.point(p));
+                changed.push_back(id);
             }
+            mOwner[p] = NoPlane;
         }
     }
-}
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    for (std::uint32_t id : changed)
+    {
+        if (mPlanes[id]->getCount() < unsigned(params.numPoints))
+            mPlanes[id].reset();
+        else
+            mPlanes[id]->computeEquation();
+    }
 
-void Octree::Node::detectPlanes(int depthThreshold, double epsilon, int numStartPoints, int numPoints, int steps, double countRatio, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFind<SharedPoint, std::pair<RGB, bool>>& colors, double dCos, std::vector<SharedPoint>& pts) const
-{
-    if (count > depthThreshold)
+    // Subtrees are disjoint, like siblings in detectPlanes.
+    std::uint32_t seed = generator();
+    std::vector<std::vector<SharedPlane>> found(subtrees.size());
     {
-        std::vector<SharedPlane> plns;
-        for (auto&& child : children)
+        TaskScheduler::Group group(scheduler);
+        for (std::size_t s = 0 ; s < subtrees.size() ; ++s)
         {
-            std::vector<SharedPoint> child_pts;
-            if (child.get() != nullptr)
-            {
-                child->detectPlanes(depthThreshold, epsilon, numStartPoints, numPoints, steps, countRatio, generator, plns, colors, dCos, child_pts);
-                for (auto&& p : child_pts)
-                    pts.push_back(p);
-            }
+            group.run([&, s]() {
+                std::vector<PointIndex> pts;
+                subtrees[s].first->detectPlanes(mCloud, params, PlaneDetection::childSeed(seed, s), subtrees[s].second, found[s], colors, pts, scheduler);
+            });
         }
-        
-        removeSmallPlanes(plns, countRatio, colors);
+        group.wait();
+    }
 
-        for (unsigned int i = 0 ; i < plns.size() ; ++i)
+    // The planes found before come first, they are not compared with each other again.
+    std::vector<SharedPlane> live;
+    std::vector<std::uint32_t> ids;
+    for (std::uint32_t id = 0 ; id < mPlanes.size() ; ++id)
+    {
+        if (mPlanes[id])
         {
-            for (unsigned int j = 0 ; j < i ; ++j)
-            {
-                if (plns[i] && plns[j] && plns[i]->mergeableWith(*plns[j], dCos))
-                {
-                    plns[i]->merge(*plns[j], colors);
-                    plns[j].reset();
-                }
-            }
+            live.push_back(mPlanes[id]);
+            ids.push_back(id);
         }
+    }
+    const std::size_t first = live.size();
+    for (std::vector<SharedPlane>& plns : found)
+    {
+        for (SharedPlane& plane : plns)
+        {
+            std::uint32_t id = mPlanes.size();
+            for (PointIndex i : plane->members(colors))
+                mOwner[i] = id;
+            plane->clearMembers();
+            mPlanes.push_back(plane);
+            mGroups.append(id, id);
+            live.push_back(plane);
+            ids.push_back(id);
+        }
+    }
 
-        removeSmallPlanes(plns, countRatio, colors);
+    PlaneDetection::mergePlanes(live, params.dCos, first, [&](std::uint32_t i, std::uint32_t j) {
+        live[i]->merge(*live[j]);
+        mGroups.merge(ids[j], ids[i]);
+        mPlanes[ids[j]].reset();
+    });
 
-        for (auto&& p : pts)
+    unsigned int largest = 0;
+    for (const SharedPlane& plane : live)
+        if (plane)
+            largest = std::max(largest, plane->getCount());
+    for (std::size_t k = 0 ; k < live.size() ; ++k)
+    {
+        if (live[k] && live[k]->getCount() <= largest * params.countRatio)
         {
-            if (!colors.at(p).second)
+            mPlanes[ids[k]].reset();
+            live[k].reset();
+            Metrics::add(Metrics::PlanesRemoved);
+        }
+    }
+
+    // Give the points of the dirty subtrees left without plane to the closest one, as mergeChildren does.
+    PlaneIndex index;
+    index.build(live);
+    std::vector<bool> grown(live.size());
+    std::uint64_t reassigned = 0;
+    for (const std::vector<PointIndex>& pts : points)
+    {
+        for (PointIndex p : pts)
+        {
+            if (this->owner(p) != NoPlane)
+                continue;
+            int closest = index.closest(mCloud.point(p));
+            if (closest >= 0)
             {
-                std::vector<std::pair<SharedPlane, double> > dist;
-                for (SharedPlane plane : plns)
-                    if (plane && plane->accept(p))
-                        dist.push_back(std::make_pair(plane, plane->squareDistance(p)));
-
-                if (!dist.empty())
-                {
-                    std::sort(dist.begin(), dist.end(), [](const std::pair<SharedPlane, double>& a, const std::pair<SharedPlane, double>& b){ return a.second < b.second; });
-                    dist[0].first->addPoint(p, colors);
-                }
+                live[closest]->addPoint(mCloud.point(p));
+                mOwner[p] = ids[closest];
+                grown[closest] = true;
+                ++reassigned;
             }
         }
+    }
+    Metrics::add(Metrics::PointsReassigned, reassigned);
 
-        for (SharedPlane plane : plns)
+    planes.clear();
+    for (std::size_t k = 0 ; k < live.size() ; ++k)
+    {
+        if (!live[k])
+            continue;
+        if (grown[k])
+            live[k]->computeEquation();
+        planes.push_back(live[k]);
+    }
+}
+
+std::uint32_t Octree::owner(PointIndex p) const
+{
+    if (mOwner[p] == NoPlane)
+        return NoPlane;
+    std::uint32_t id = mGroups.at(mOwner[p]);
+    return mPlanes[id] ? id : NoPlane;
+}
+
+void Octree::detectPlanes(const DetectionParams& params, std::default_random_engine& generator, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler) const
+{
+    std::vector<PointIndex> pts;
+    mRoot.detectPlanes(mCloud, params, generator(), 0, planes, colors, pts, scheduler);
+    if (params.globalMerge)
+        PlaneDetection::mergeAll(planes, params.dCos, colors);
+}
+
+Octree::Node::Node(const Vec3d& center, const Vec3d& halfSize) :
+    center(center), halfSize(halfSize), point(InvalidPoint), count(0), dirty(false)
+{
+}
+
+void Octree::Node::collectDirty(unsigned int maxCount, unsigned int depth, std::vector<std::pair<const Node*, unsigned int>>& subtrees)
+{
+    if (!dirty)
+        return;
+    if (isLeafNode() || count <= maxCount)
+    {
+        subtrees.emplace_back(this, depth);
+        this->clearDirty();
+        return;
+    }
+    dirty = false;
+    for (auto&& child : children)
+        child->collectDirty(maxCount, depth + 1, subtrees);
+}
+
+void Octree::Node::clearDirty()
+{
+    if (!dirty)
+        return;
+    dirty = false;
+    if (!isLeafNode())
+        for (auto&& child : children)
+            child->clearDirty();
+}
+
+void Octree::Node::getPoints(std::vector<PointIndex>& pts) const
+{
+    if (isLeafNode())
+    {
+        if (point != InvalidPoint)
+            pts.push_back(point);
+    }
+    else
+        for (auto&& child : children)
+            child->getPoints(pts);
+}
+
+// Subtrees are processed as independent tasks. Each one only touches the labels of
+// its own points, which are disjoint from those of its siblings, so colors needs no
+// locking; results are gathered in child order to stay independent of scheduling.
+void Octree::Node::detectPlanes(const PointCloud& cloud, const DetectionParams& params, std::uint32_t seed, unsigned int depth, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, std::vector<PointIndex>& pts, TaskScheduler& scheduler) const
+{
+    if (count > unsigned(params.depthThreshold))
+    {
+        std::vector<SharedPlane> child_plns[8];
+        std::vector<PointIndex> child_pts[8];
         {
-            if (plane)
+            TaskScheduler::Group group(scheduler);
+            for (int i = 0 ; i < 8 ; ++i)
             {
-                plane->computeEquation();
-                planes.push_back(plane);
+                if (children[i].get() == nullptr)
+                    continue;
+                auto task = [&, i]() {
+                    children[i]->detectPlanes(cloud, params, PlaneDetection::childSeed(seed, i), depth + 1, child_plns[i], colors, child_pts[i], scheduler);
+                };
+                // Leaves are too small to be worth a task.
+                if (children[i]->count > unsigned(params.depthThreshold))
+                    group.run(task);
+                else
+                    task();
             }
+            group.wait();
+        }
+
+        Metrics::Timer timer(depth);
+        std::vector<SharedPlane> plns;
+        for (int i = 0 ; i < 8 ; ++i)
+        {
+            plns.insert(plns.end(), child_plns[i].begin(), child_plns[i].end());
+            pts.insert(pts.end(), child_pts[i].begin(), child_pts[i].end());
         }
+        
+        PlaneDetection::mergeChildren(cloud, plns, pts.data(), pts.data() + pts.size(), params, colors, planes);
     }
     else
     {
+        Metrics::Timer timer(depth);
         this->getPoints(pts);
-        std::vector<SharedPoint> remaining_pts = pts;
-        for (int i = 0 ; i < 2 ; ++i)
-        {
-            SharedPlane plane = Ransac::ransac(remaining_pts, epsilon, numStartPoints, numPoints, steps, generator, colors);
-            if (!plane)
-                return;
-            planes.push_back(plane);
-            std::uniform_int_distribution<int> distribution(0, 255);
-            auto random = std::bind(distribution, generator);
-            plane->setColor(RGB(random(), random(), random()), colors);
-        }
+        PlaneDetection::detectInLeaf(cloud, pts.data(), pts.data() + pts.size(), params, seed, planes, colors, scheduler);
     }
 }
 
-int Octree::Node::findOctant(SharedPoint p) const
+int Octree::Node::findOctant(const Point& p) const
 {
     int oct = 0;
-    if (p->x >= center.x) oct |= 4;
-    if (p->y >= center.y) oct |= 2;
-    if (p->z >= center.z) oct |= 1;
+    if (p.x >= center.x) oct |= 4;
+    if (p.y >= center.y) oct |= 2;
+    if (p.z >= center.z) oct |= 1;
     return oct;
 }
 
@@ -144,7 +289,7 @@ bool Octree::Node::isLeafNode() const
     return children[0].get() == nullptr;
 }
 
-bool Octree::Node::insert(SharedPoint p, unsigned int depth)
+bool Octree::Node::insert(const PointCloud& cloud, PointIndex p, unsigned int depth)
 {
     bool result = false;
 
@@ -155,18 +300,18 @@ bool Octree::Node::insert(SharedPoint p, unsigned int depth)
     --depth;
 
     if (!isLeafNode())
-        result = children[findOctant(p)]->insert(p, depth);
+        result = children[findOctant(cloud.point(p))]->insert(cloud, p, depth);
     else
     {
-        if (point.get() == nullptr)
+        if (point == InvalidPoint)
         {
             point = p;
             result = true;
         }
         else
         {
-            SharedPoint oldPoint = point;
-            point.reset();
+            PointIndex oldPoint = point;
+            point = InvalidPoint;
 
             for (int i = 0 ; i < 8 ; ++i)
             {
@@ -177,8 +322,8 @@ bool Octree::Node::insert(SharedPoint p, unsigned int depth)
                 children[i] = std::make_shared<Node>(newCenter, halfSize / 2);
             }
 
-            result = children[findOctant(oldPoint)]->insert(oldPoint, depth)
-                    && children[findOctant(p)]->insert(p, depth);
+            result = children[findOctant(cloud.point(oldPoint))]->insert(cloud, oldPoint, depth)
+                    && children[findOctant(cloud.point(p))]->insert(cloud, p, depth);
 
             if (!result)
             {
@@ -190,6 +335,9 @@ bool Octree::Node::insert(SharedPoint p, unsigned int depth)
     }
 
     if (result)
+    {
         ++count;
+        dirty = true;
+    }
     return result;
 }
@@ -0,0 +1,155 @@
+#include "ParameterSweep.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+bool ParameterSweep::read(const std::string& filename, const DetectionParams& defaults)
+{
+    std::ifstream in(filename.c_str());
+    if (!in)
+    {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (unsigned int number = 1 ; std::getline(in, line) ; ++number)
+    {
+        // Values of each parameter of the line.
+        std::vector<std::pair<std::string, std::vector<std::string>>> grid;
+        std::istringstream words(line);
+        std::string word;
+        while (words >> word && word[0] != '#')
+        {
+            std::size_t equal = word.find('=');
+            if (equal == std::string::npos || equal + 1 == word.size())
+            {
+                std::cerr << filename << ":" << number << ": expected name=value instead of " << word << std::endl;
+                return false;
+            }
+            grid.emplace_back(word.substr(0, equal), std::vector<std::string>());
+            std::istringstream values(word.substr(equal + 1));
+            std::string value;
+            while (std::getline(values, value, ','))
+            {
+                DetectionParams check;
+                char* end = nullptr;
+                double v = std::strtod(value.c_str(), &end);
+                if (value.empty() || *end || !setParam(check, grid.back().first, v))
+                {
+                    std::cerr << filename << ":" << number << ": invalid " << grid.back().first << "=" << value << std::endl;
+                    return false;
+                }
+                grid.back().second.push_back(value);
+            }
+        }
+        if (grid.empty())
+            continue;
+
+        // Every combination, the first parameter changing the slowest.
+        std::vector<std::size_t> choice(grid.size(), 0);
+        while (true)
+        {
+            Set set = {defaults, "", 0, 0, 0, 0};
+            for (std::size_t k = 0 ; k < grid.size() ; ++k)
+            {
+                const std::string& value = grid[k].second[choice[k]];
+                setParam(set.params, grid[k].first, std::strtod(value.c_str(), nullptr));
+                set.name += (k ? " " : "") + grid[k].first + "=" + value;
+            }
+            mSets.push_back(set);
+
+            std::size_t k = grid.size();
+            while (k > 0 && ++choice[k - 1] == grid[k - 1].second.size())
+                choice[--k] = 0;
+            if (k == 0)
+                break;
+        }
+    }
+    return true;
+}
+
+void ParameterSweep::run(const UnionFindPlanes& colors, std::size_t points, unsigned int minPoints, const Detector& detector, TaskScheduler& scheduler)
+{
+    TaskScheduler::Group group(scheduler);
+    for (std::size_t s = 0 ; s < mSets.size() ; ++s)
+    {
+        group.run([&, s]() {
+            Set& set = mSets[s];
+            auto start = std::chrono::steady_clock::now();
+            UnionFindPlanes labels = colors;
+            std::vector<SharedPlane> planes;
+            detector(set.params, planes, labels);
+            set.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            set.planes = planes.size();
+            for (const SharedPlane& plane : planes)
+                set.largePlanes += plane->getCount() >= minPoints;
+            std::size_t covered = 0;
+            for (PointIndex i = 0 ; i < points ; ++i)
+                covered += labels.at(i).second;
+            set.coverage = points ? double(covered) / points : 0;
+        });
+    }
+    group.wait();
+}
+
+bool ParameterSweep::write(const std::string& filename) const
+{
+    std::ofstream out(filename.c_str());
+    out << "set\tplanes\tlarge_planes\tcoverage\tseconds" << std::endl;
+    for (const Set& set : mSets)
+    {
+        out << set.name << "\t" << set.planes << "\t" << set.largePlanes << "\t" << set.coverage << "\t" << set.seconds << std::endl;
+        std::cout << std::fixed << std::setprecision(3)
+                  << std::setw(8) << set.planes << " planes, " << std::setw(6) << set.largePlanes << " large, coverage "
+                  << std::setw(5) << 100 * set.coverage << "%, " << std::setw(8) << set.seconds << " s : "
+                  << (set.name.empty() ? "defaults" : set.name) << std::endl;
+    }
+    std::cout << std::defaultfloat;
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Cannot write " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ParameterSweep::setParam(DetectionParams& params, const std::string& name, double value)
+{
+    if (name == "depth-threshold")
+        params.depthThreshold = int(value);
+    else if (name == "epsilon")
+        params.epsilon = value;
+    else if (name == "start-points")
+        params.numStartPoints = int(value);
+    else if (name == "min-points")
+        params.numPoints = int(value);
+    else if (name == "steps")
+        params.steps = int(value);
+    else if (name == "count-ratio")
+        params.countRatio = value;
+    else if (name == "angle")
+        params.dCos = std::cos(3.1415/180 * value);
+    else if (name == "global-merge")
+        params.globalMerge = value != 0;
+    else if (name == "confidence")
+        params.confidence = value;
+    else if (name == "preemptive-subset")
+        params.preemptiveSubset = int(value);
+    else if (name == "preemptive-ratio")
+        params.preemptiveRatio = value;
+    else if (name == "normal-angle")
+        params.normalCos = std::cos(3.1415/180 * value);
+    else if (name == "max-curvature")
+        params.maxCurvature = value;
+    else
+        return false;
+    return true;
+}
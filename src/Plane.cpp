@@ -2,6 +2,7 @@
 #include "PointCloud.h"
 
 #include "Vec3.h"
+#include <algorithm>
 #include <cmath>
 
 std::ostream& operator<<(std::ostream& os, const Plane& p)
@@ -11,55 +12,118 @@ std::ostream& operator<<(std::ostream& os, const Plane& p)
 
 
 Plane::Plane() :
-    m(3, 3, CV_64FC1)
+    point(InvalidPoint)
 {
     this->init();
     d = 0;
 }
 
-Plane::Plane(const std::vector<SharedPoint>& pts) :
-    m(3, 3, CV_64FC1)
+Plane::Plane(const PointCloud& cloud, const std::vector<PointIndex>& pts) :
+    point(InvalidPoint)
 {
-    this->setPoints(pts);
+    this->setPoints(cloud, pts);
 }
 
 
-double Plane::distance(SharedPoint p)
+double Plane::distance(const Point& p) const
 {
-    return std::abs((normal * *p) + d);
+    return std::abs((normal * Vec3d(p)) + d);
 }
 
-double Plane::squareDistance(SharedPoint p)
+double Plane::squareDistance(const Point& p) const
 {
-    double diff = (normal * *p) + d;
+    double diff = (normal * Vec3d(p)) + d;
     return diff * diff;
 }
 
-bool Plane::accept(SharedPoint p)
+bool Plane::accept(const Point& p) const
 {
-    return (center.distance(*p) < 3 * radius) && (this->distance(p) < 2 * thickness);
+    return (center.distance(Vec3d(p)) < 3 * radius) && (this->distance(p) < 2 * thickness);
 }
 
-void Plane::addPoint(SharedPoint p, UnionFindPlanes& colors)
+bool Plane::mayAccept(const Vec3d& min, const Vec3d& max) const
 {
-    this->addPoint(*p);
-    if (point)
-        colors.merge(p, point);
+    Vec3d closest;
+    for (int a = 0 ; a < 3 ; ++a)
+        closest[a] = std::max(min[a], std::min(center[a], max[a]));
+    if (center.distance(closest) >= 3 * radius)
+        return false;
+
+    // The box must also reach the slab around the plane.
+    Vec3d middle = (min + max) / 2;
+    Vec3d half = (max - min) / 2;
+    double reach = half.x * std::abs(normal.x) + half.y * std::abs(normal.y) + half.z * std::abs(normal.z);
+    return std::abs(normal * middle + d) < 2 * thickness + reach;
+}
+
+void Plane::bounds(Vec3d& min, Vec3d& max) const
+{
+    // Disk of radius 3 * radius around the center, 2 * thickness thick on each side.
+    for (int a = 0 ; a < 3 ; ++a)
+    {
+        double n = std::min(1.0, std::abs(normal[a]));
+        double extent = 3 * radius * std::sqrt(1 - n * n) + 2 * thickness * n;
+        min[a] = center[a] - extent;
+        max[a] = center[a] + extent;
+    }
+}
+
+void Plane::addPoint(const PointCloud& cloud, PointIndex i, UnionFindPlanes& colors)
+{
+    this->addPoint(cloud.point(i));
+    colors.setNext(i, InvalidPoint);
+    if (mLast != InvalidPoint)
+        colors.setNext(mLast, i);
     else
-        point = p;
+        mFirst = i;
+    mLast = i;
+    if (point != InvalidPoint)
+        colors.merge(i, point);
+    else
+        point = i;
 }
 
-void Plane::setPoints(const std::vector<SharedPoint>& pts)
+void Plane::setPoints(const PointCloud& cloud, const std::vector<PointIndex>& pts)
 {
     if (!pts.empty())
         point = pts[0];
 
     this->init();
-    for (auto&& p : pts)
-        this->addPoint(*p);
+    for (PointIndex i : pts)
+        this->addPoint(cloud.point(i));
     this->computeEquation();
 }
 
+void Plane::setMembers(const std::vector<PointIndex>& pts, UnionFindPlanes& colors)
+{
+    this->clearMembers();
+    for (std::size_t k = 0 ; k < pts.size() ; ++k)
+    {
+        colors.merge(pts[k], pts[0]);
+        colors.setNext(pts[k], k + 1 < pts.size() ? pts[k + 1] : InvalidPoint);
+    }
+    if (!pts.empty())
+    {
+        mFirst = pts.front();
+        mLast = pts.back();
+    }
+}
+
+std::vector<PointIndex> Plane::members(const UnionFindPlanes& colors) const
+{
+    std::vector<PointIndex> pts;
+    pts.reserve(count);
+    for (PointIndex i = mFirst ; i != InvalidPoint ; i = colors.next(i))
+        pts.push_back(i);
+    return pts;
+}
+
+void Plane::clearMembers()
+{
+    mFirst = InvalidPoint;
+    mLast = InvalidPoint;
+}
+
 void Plane::setColor(RGB color, UnionFindPlanes& colors)
 {
     colors.set(point, std::make_pair(color, true));
@@ -72,14 +136,31 @@ void Plane::destroy(UnionFindPlanes& colors)
 
 void Plane::merge(Plane& p, UnionFindPlanes& colors)
 {
-    for (auto pt: p.points()) {
-        mPoints.push_back(pt);
+    colors.merge(point, p.point);
+    // Splice the list of p after the list of this.
+    if (p.mFirst != InvalidPoint)
+    {
+        if (mLast != InvalidPoint)
+            colors.setNext(mLast, p.mFirst);
+        else
+            mFirst = p.mFirst;
+        mLast = p.mLast;
     }
+    this->mergeStatistics(p);
+}
+
+void Plane::merge(Plane& p)
+{
+    this->clearMembers();
+    this->mergeStatistics(p);
+}
+
+void Plane::mergeStatistics(Plane& p)
+{
     count += p.count;
     m += p.m;
     sum += p.sum;
     this->computeEquation();
-    colors.merge(point, p.point);
     p = Plane();
 }
 
@@ -91,7 +172,23 @@ bool Plane::mergeableWith(const Plane& p, double dCos) const {
         return false;
     if (this->distanceAlong(center, p.center) > thickness && p.distanceAlong(center, p.center) > p.thickness)
         return false;
+    return this->fitsMerged(p, dCos);
+}
+
+bool Plane::mergeableAcross(const Plane& p, double dCos) const {
+    if (!(count && p.count))
+        return false;
+
+    if (this->getCos(p) < dCos)
+        return false;
+    if (this->distanceAlong(center, p.center) > thickness + p.thickness && p.distanceAlong(center, p.center) > thickness + p.thickness)
+        return false;
+    return this->fitsMerged(p, dCos);
+}
 
+bool Plane::fitsMerged(const Plane& p, double dCos) const
+{
+    // Cheap: no heap allocation until points are added.
     Plane tempPlane;
     tempPlane.m = m + p.m;
     tempPlane.sum = sum + p.sum;
@@ -111,50 +208,75 @@ bool Plane::mergeableWith(const Plane& p, double dCos) const {
 void Plane::init()
 {
     count = 0;
+    this->clearMembers();
 
-    for (unsigned int i = 0 ; i < 3 ; ++i)
-        for (unsigned int j = 0 ; j < 3 ; ++j)
-            m.at<double>(i, j) = 0;
+    m = Mat3d();
     sum = Vec3d();
 
     center = Vec3d();
     radius = 0;
 }
 
-void Plane::addPoint(const Point& p)
+void Plane::addPoint(const Point& position)
 {
-    mPoints.push_back(std::make_shared<Point>(p));
+    // Products in double, even for float coordinates.
+    Vec3d p(position);
     ++count;
 
-    m.at<double>(0, 0) += p.x * p.x;
-    m.at<double>(0, 1) += p.x * p.y;
-    m.at<double>(0, 2) += p.x * p.z;
+    double xy = p.x * p.y;
+    double xz = p.x * p.z;
+    double yz = p.y * p.z;
+
+    m(0, 0) += p.x * p.x;
+    m(0, 1) += xy;
+    m(0, 2) += xz;
 
-    m.at<double>(1, 0) += p.y * p.x;
-    m.at<double>(1, 1) += p.y * p.y;
-    m.at<double>(1, 2) += p.y * p.z;
+    m(1, 0) += xy;
+    m(1, 1) += p.y * p.y;
+    m(1, 2) += yz;
 
-    m.at<double>(2, 0) += p.z * p.x;
-    m.at<double>(2, 1) += p.z * p.y;
-    m.at<double>(2, 2) += p.z * p.z;
+    m(2, 0) += xz;
+    m(2, 1) += yz;
+    m(2, 2) += p.z * p.z;
 
     sum += p;
 }
 
+void Plane::removePoint(const Point& position)
+{
+    // Products in double, even for float coordinates.
+    Vec3d p(position);
+    --count;
+
+    double xy = p.x * p.y;
+    double xz = p.x * p.z;
+    double yz = p.y * p.z;
+
+    m(0, 0) -= p.x * p.x;
+    m(0, 1) -= xy;
+    m(0, 2) -= xz;
+
+    m(1, 0) -= xy;
+    m(1, 1) -= p.y * p.y;
+    m(1, 2) -= yz;
+
+    m(2, 0) -= xz;
+    m(2, 1) -= yz;
+    m(2, 2) -= p.z * p.z;
+
+    sum -= p;
+}
+
 void Plane::leastSquares()
 {
-    cv::Mat mat(3, 3, CV_64FC1);
-    for (unsigned int i = 0 ; i < 3 ; ++i)
-        for (unsigned int j = 0 ; j < 3 ; ++j)
-            mat.at<double>(i, j) = m.at<double>(i, j) - sum[i] * sum[j] / count;
+    Mat3d covariance = m - Mat3d::outer(sum, sum) / count;
 
-    cv::Mat eigenvals;
-    cv::Mat eigenvects;
-    cv::eigen(mat, eigenvals, eigenvects);
+    Vec3d eigenvals;
+    Mat3d eigenvects;
+    covariance.eigenSymmetric(eigenvals, eigenvects);
 
-    normal[0] = eigenvects.at<double>(2, 0);
-    normal[1] = eigenvects.at<double>(2, 1);
-    normal[2] = eigenvects.at<double>(2, 2);
+    // Direction of least variance.
+    normal = Vec3d(eigenvects(2, 0), eigenvects(2, 1), eigenvects(2, 2));
     normal.normalize();
     d = - (normal * sum) / count;
 }
@@ -165,15 +287,11 @@ void Plane::computeEquation()
 
     center = sum / count;
 
-    Vec3d stddev = (Vec3d(m.at<double>(0, 0), m.at<double>(1, 1), m.at<double>(2, 2)) / count)
+    Vec3d stddev = (Vec3d(m(0, 0), m(1, 1), m(2, 2)) / count)
             - center.cmul(center);
     radius = std::sqrt(stddev.x + stddev.y + stddev.z);
 
-    double meansq = 0;
-    for (unsigned int i = 0 ; i < 3 ; ++i)
-        for (unsigned int j = 0 ; j < 3 ; ++j)
-            meansq += m.at<double>(i, j) * normal[i] * normal[j];
-    meansq /= count;
+    double meansq = m.quadratic(normal) / count;
 
     double mean = d; // (normal * sum) / count;
 
@@ -186,6 +304,16 @@ void Plane::computeEquation()
         thickness = radius / 1000;
 }
 
+void Plane::translate(const Vec3d& offset)
+{
+    m += Mat3d::outer(sum, offset) + Mat3d::outer(offset, sum) + Mat3d::outer(offset, offset) * double(count);
+    sum += offset * double(count);
+    center += offset;
+    d -= normal * offset;
+    for (Point& p : mSegments)
+        p = Point(Vec3d(p) + offset);
+}
+
 double Plane::distanceAlong(Vec3d u, Vec3d v) const
 {
     return std::abs((v - u) * normal);
@@ -197,25 +325,14 @@ double Plane::getCos(const Plane& p) const
 }
 
 
-void Plane::flatten()
-{
-    cv::Vec3d n = {normal.x, normal.y, normal.z};
-    double den1 = std::sqrt(n[0]*n[0] + n[1]*n[1]);
-    cv::Mat r1 = (cv::Mat1d(3, 3) << n[0]/den1,  n[1]/den1, 0,  
-                                       -n[1]/den1, n[0]/den1, 0,
-                                       0,         0,        1);
-    double den2 = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
-    cv::Mat r2 = (cv::Mat1d(3, 3) << n[2]/den2, 0, -den1/den2,  
-                                       0       , 1, 0, 
-                                       den1/den2, 0, n[2]/den2);
-    cv::Mat r = r2*r1;
-    cv::Mat rInv = r.inv();
-    for (auto p: mPoints) {
-        cv::Mat pNew = r*(cv::Mat1d(3, 1) << p->x + d*n[0], p->y + d*n[1], p->z + d*n[2]);
-        pNew = rInv*(cv::Mat1d(3, 1) << pNew.at<double>(0, 0), pNew.at<double>(1, 0), 0);
-        p->x = pNew.at<double>(0, 0) - d*n[0];
-        p->y = pNew.at<double>(1, 0) - d*n[1];
-        p->z = pNew.at<double>(2, 0) - d*n[2];
-    }
+void Plane::flatten(PointCloud& cloud)
+{
+    std::vector<PointIndex> pts = this->members(cloud.colors());
+    this->project(cloud, pts.data(), pts.data() + pts.size());
+}
 
+void Plane::project(PointCloud& cloud, const PointIndex* begin, const PointIndex* end) const
+{
+    // The normal has unit length, the projection is p - (normal * p + d) * normal.
+    cloud.project(begin, end, normal, d);
 }
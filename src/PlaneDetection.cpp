@@ -0,0 +1,224 @@
+#include "PlaneDetection.h"
+
+#include "MergeIndex.h"
+#include "Metrics.h"
+#include "Philox.h"
+#include "PlaneIndex.h"
+#include "Ransac.h"
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+// Smaller sets of planes are compared pairwise.
+const std::size_t MinIndexedPlanes = 32;
+// Random stream of the color of a plane, apart from those of the RANSAC hypotheses.
+const std::uint64_t ColorStream = ~std::uint64_t(0) - 1;
+
+}
+
+void PlaneDetection::detectInLeaf(const PointCloud& cloud, const PointIndex* begin, const PointIndex* end, const DetectionParams& params, std::uint32_t seed, std::vector<SharedPlane>& planes, UnionFindPlanes& colors, TaskScheduler& scheduler)
+{
+    std::vector<PointIndex> remaining_pts(begin, end);
+    for (int i = 0 ; i < 2 ; ++i)
+    {
+        // One key per plane of the leaf.
+        std::uint64_t key = std::uint64_t(i) << 32 | seed;
+        SharedPlane plane = Ransac::ransac(cloud, remaining_pts, params, key, colors, scheduler);
+        if (!plane)
+            return;
+        planes.push_back(plane);
+        Philox random(key, ColorStream);
+        std::uint32_t bits = random.next();
+        plane->setColor(RGB(bits & 255, (bits >> 8) & 255, (bits >> 16) & 255), colors);
+    }
+}
+
+void PlaneDetection::mergeChildren(const PointCloud& cloud, std::vector<SharedPlane>& plns, const PointIndex* begin, const PointIndex* end, const DetectionParams& params, UnionFindPlanes& colors, std::vector<SharedPlane>& planes)
+{
+    removeSmallPlanes(plns, params.countRatio, colors);
+    mergePlanes(plns, params.dCos, colors);
+    removeSmallPlanes(plns, params.countRatio, colors);
+
+    // Adding points does not change the equations until computeEquation, so the index stays valid.
+    PlaneIndex index;
+    index.build(plns);
+    std::uint64_t reassigned = 0;
+    for (const PointIndex* it = begin ; it != end ; ++it)
+    {
+        PointIndex p = *it;
+        if (!colors.at(p).second)
+        {
+            int closest = index.closest(cloud.point(p));
+            if (closest >= 0)
+            {
+                plns[closest]->addPoint(cloud, p, colors);
+                ++reassigned;
+            }
+        }
+    }
+    Metrics::add(Metrics::PointsReassigned, reassigned);
+
+    for (SharedPlane plane : plns)
+    {
+        if (plane)
+        {
+            plane->computeEquation();
+            planes.push_back(plane);
+        }
+    }
+}
+
+std::size_t PlaneDetection::mergePlanes(std::vector<SharedPlane>& plns, double dCos, UnionFindPlanes& colors)
+{
+    return mergePlanes(plns, dCos, 0, [&](std::uint32_t i, std::uint32_t j) {plns[i]->merge(*plns[j], colors);});
+}
+
+std::size_t PlaneDetection::mergePlanes(std::vector<SharedPlane>& plns, double dCos, std::size_t first, const std::function<void(std::uint32_t, std::uint32_t)>& merge)
+{
+    std::uint64_t attempted = 0;
+    std::uint64_t performed = 0;
+    if (plns.size() < MinIndexedPlanes)
+    {
+        for (unsigned int i = first ; i < plns.size() ; ++i)
+        {
+            for (unsigned int j = 0 ; j < i ; ++j)
+            {
+                if (!(plns[i] && plns[j]))
+                    continue;
+                ++attempted;
+                if (plns[i]->mergeableWith(*plns[j], dCos))
+                {
+                    merge(i, j);
+                    plns[j].reset();
+                    ++performed;
+                }
+            }
+        }
+    }
+    else
+    {
+        // Same merges as above: the planes skipped by the index are not mergeable. Planes
+        // before i no longer change, except when merged into i, so they are indexed once
+        // they are done, and i is looked up again after each merge.
+        MergeIndex index(plns, dCos);
+        std::vector<std::uint32_t> candidates;
+        for (std::uint32_t i = 0 ; i < plns.size() ; ++i)
+        {
+            if (!plns[i])
+                continue;
+            std::uint32_t next = 0;
+            bool merged = i >= first;
+            while (merged)
+            {
+                merged = false;
+                index.candidates(*plns[i], candidates);
+                for (std::uint32_t j : candidates)
+                {
+                    if (j < next || !plns[j])
+                        continue;
+                    next = j + 1;
+                    ++attempted;
+                    if (plns[i]->mergeableWith(*plns[j], dCos))
+                    {
+                        merge(i, j);
+                        plns[j].reset();
+                        ++performed;
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+            index.insert(i);
+        }
+    }
+    Metrics::add(Metrics::MergesAttempted, attempted);
+    Metrics::add(Metrics::MergesPerformed, performed);
+    return performed;
+}
+
+void PlaneDetection::mergeAll(std::vector<SharedPlane>& planes, double dCos, UnionFindPlanes& colors)
+{
+    Metrics::Timer timer("global_merge");
+    // Merges change the planes, which may make others mergeable.
+    while (mergePlanes(planes, dCos, colors))
+        planes.erase(std::remove(planes.begin(), planes.end(), nullptr), planes.end());
+}
+
+void PlaneDetection::removeSmallPlanes(std::vector<SharedPlane>& planes, double countRatio, UnionFindPlanes& colors)
+{
+    if (!planes.empty())
+    {
+        static auto comp = [](const SharedPlane& a, const SharedPlane& b){return a && b ? a->getCount() > b->getCount() : (bool)a;};
+        std::sort(planes.begin(), planes.end(), comp);
+
+        if (planes[0])
+        {
+            double minCount = planes[0]->getCount() * countRatio;
+            for (SharedPlane& p : planes)
+            {
+                if (p && p->getCount() <= minCount)
+                {
+                    p->destroy(colors);
+                    p.reset();
+                    Metrics::add(Metrics::PlanesRemoved);
+                }
+            }
+        }
+    }
+}
+
+void PlaneDetection::projectPoints(PointCloud& cloud, std::vector<SharedPlane>& planes, TaskScheduler& scheduler)
+{
+    std::vector<int> owner;
+    closestPlanes(cloud, planes, owner, scheduler);
+    projectPoints(cloud, planes, owner, scheduler);
+}
+
+void PlaneDetection::closestPlanes(const PointCloud& cloud, const std::vector<SharedPlane>& planes, std::vector<int>& owner, TaskScheduler& scheduler)
+{
+    PlaneIndex index;
+    index.build(planes);
+
+    owner.resize(cloud.size());
+    scheduler.parallelFor(0, cloud.size(), 1 << 14, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin ; i < end ; ++i)
+            owner[i] = index.closest(cloud.point(i));
+    });
+}
+
+void PlaneDetection::projectPoints(PointCloud& cloud, std::vector<SharedPlane>& planes, const std::vector<int>& owner, TaskScheduler& scheduler)
+{
+    // The points accepted by each plane, which are not its members.
+    std::vector<std::vector<PointIndex>> accepted(planes.size());
+    std::uint64_t acceptedCount = 0;
+    for (PointIndex i = 0 ; i < cloud.size() ; ++i)
+    {
+        if (owner[i] >= 0)
+        {
+            accepted[owner[i]].push_back(i);
+            ++acceptedCount;
+        }
+    }
+    Metrics::add(Metrics::PointsAccepted, acceptedCount);
+
+    // Each plane only moves its own points. Large planes are cut in several chunks.
+    const std::size_t chunk = 1 << 14;
+    std::vector<std::pair<std::size_t, std::size_t>> chunks;
+    for (std::size_t k = 0 ; k < planes.size() ; ++k)
+        for (std::size_t b = 0 ; b < accepted[k].size() ; b += chunk)
+            chunks.emplace_back(k, b);
+    scheduler.parallelFor(0, chunks.size(), 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t c = begin ; c < end ; ++c)
+        {
+            const std::vector<PointIndex>& pts = accepted[chunks[c].first];
+            std::size_t b = chunks[c].second;
+            planes[chunks[c].first]->project(cloud, pts.data() + b, pts.data() + std::min(pts.size(), b + chunk));
+        }
+    });
+}
+
+std::uint32_t PlaneDetection::childSeed(std::uint32_t seed, int i)
+{
+    return mix64((std::uint64_t(seed) << 8 | i) + 0x9e3779b97f4a7c15ull);
+}
@@ -0,0 +1,133 @@
+#include "PlaneIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Cells along each axis, relative to the cube root of the number of planes, and at most.
+const double CellsPerPlane = 2;
+const int MaxCells = 64;
+
+}
+
+void PlaneIndex::build(const std::vector<SharedPlane>& planes)
+{
+    struct Bounds
+    {
+        Vec3d min;
+        Vec3d max;
+    };
+    std::vector<Bounds> bounds(planes.size());
+    mEntries.resize(planes.size());
+
+    const double infinity = std::numeric_limits<double>::max();
+    mMin = Vec3d(infinity, infinity, infinity);
+    Vec3d max(-infinity, -infinity, -infinity);
+    std::size_t count = 0;
+    for (std::size_t i = 0 ; i < planes.size() ; ++i)
+    {
+        if (!planes[i])
+            continue;
+        const Plane& plane = *planes[i];
+        Entry entry = {plane.normal, plane.d, plane.getCenter(), 3 * plane.getRadius(), 2 * plane.getThickness()};
+        mEntries[i] = entry;
+        plane.bounds(bounds[i].min, bounds[i].max);
+        mMin.min(bounds[i].min);
+        max.max(bounds[i].max);
+        ++count;
+    }
+
+    // Planes are only stored in the cells their slab crosses, so that finer grids pay off.
+    int cells = count ? std::max(1, std::min(MaxCells, int(std::ceil(CellsPerPlane * std::cbrt(double(count)))))) : 1;
+    for (int a = 0 ; a < 3 ; ++a)
+    {
+        double extent = count ? max[a] - mMin[a] : 0;
+        mCells[a] = extent > 0 ? cells : 1;
+        mCellSize[a] = extent > 0 ? extent / cells : 1;
+    }
+
+    const Vec3d padding = mCellSize * 1e-9;
+
+    // Counting sort of the planes into the cells they overlap.
+    const std::size_t total = std::size_t(mCells[0]) * mCells[1] * mCells[2];
+    mCellStart.assign(total + 1, 0);
+    mCellPlanes.clear();
+    auto range = [&](const Bounds& b, int a, int& first, int& last) {
+        first = std::max(0, std::min(mCells[a] - 1, int((b.min[a] - mMin[a]) / mCellSize[a])));
+        last = std::max(0, std::min(mCells[a] - 1, int((b.max[a] - mMin[a]) / mCellSize[a])));
+    };
+    for (int pass = 0 ; pass < 2 ; ++pass)
+    {
+        if (pass == 1)
+        {
+            for (std::size_t c = 0 ; c < total ; ++c)
+                mCellStart[c + 1] += mCellStart[c];
+            mCellPlanes.resize(mCellStart[total]);
+        }
+        std::vector<std::uint32_t> next(mCellStart.begin(), mCellStart.end() - 1);
+        for (std::size_t i = 0 ; i < planes.size() ; ++i)
+        {
+            if (!planes[i])
+                continue;
+            int first[3], last[3];
+            for (int a = 0 ; a < 3 ; ++a)
+                range(bounds[i], a, first[a], last[a]);
+            for (int x = first[0] ; x <= last[0] ; ++x)
+                for (int y = first[1] ; y <= last[1] ; ++y)
+                    for (int z = first[2] ; z <= last[2] ; ++z)
+                    {
+                        // Padded, points are binned with rounding errors.
+                        Vec3d low(mMin.x + x * mCellSize.x, mMin.y + y * mCellSize.y, mMin.z + z * mCellSize.z);
+                        if (!planes[i]->mayAccept(low - padding, low + mCellSize + padding))
+                            continue;
+                        std::size_t c = (std::size_t(x) * mCells[1] + y) * mCells[2] + z;
+                        if (pass == 0)
+                            ++mCellStart[c + 1];
+                        else
+                            mCellPlanes[next[c]++] = i;
+                    }
+        }
+    }
+}
+
+bool PlaneIndex::cell(const Point& p, std::size_t& c) const
+{
+    int index[3];
+    for (int a = 0 ; a < 3 ; ++a)
+    {
+        double offset = (p[a] - mMin[a]) / mCellSize[a];
+        if (!(offset >= 0 && offset <= mCells[a]))
+            return false;
+        index[a] = std::min(mCells[a] - 1, int(offset));
+    }
+    c = (std::size_t(index[0]) * mCells[1] + index[1]) * mCells[2] + index[2];
+    return true;
+}
+
+int PlaneIndex::closest(const Point& p) const
+{
+    std::size_t c;
+    if (!this->cell(p, c))
+        return -1;
+
+    const Vec3d q(p);
+    int best = -1;
+    double bestDistance = 0;
+    for (std::uint32_t k = mCellStart[c] ; k < mCellStart[c + 1] ; ++k)
+    {
+        std::uint32_t i = mCellPlanes[k];
+        const Entry& e = mEntries[i];
+        double diff = (e.normal * q) + e.d;
+        if (!(std::abs(diff) < e.maxDistance) || !(e.center.distance(q) < e.maxCenterDistance))
+            continue;
+        double distance = diff * diff;
+        if (best < 0 || distance < bestDistance)
+        {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,745 @@
+#include "PlaneKernels.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PLANE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Distances are computed as ((x * nx + y * ny) + z * nz) + d in every variant, without
+// fused multiply-add, so that all of them classify borderline points the same way.
+// Squared errors are summed in double in 4 partial sums, point i going to sum i % 4 in
+// increasing order, and the sums are added as (0 + 1) + (2 + 3). Every variant keeps this
+// layout, the scalar one included, so that all of them return the same sums.
+
+namespace {
+
+// The scalar loops finish the vector ones. They are inlined so that they get the
+// same encoding: calling legacy SSE code with dirty AVX registers is very slow.
+#define PLANE_KERNELS_INLINE inline __attribute__((always_inline))
+
+// Partial sums of the squared errors.
+const std::size_t Lanes = 4;
+
+PLANE_KERNELS_INLINE double laneTotal(const double* lanes)
+{
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// Add the squared errors of the inliers to lanes and return their count.
+template <typename T>
+PLANE_KERNELS_INLINE std::size_t classifyScalar(const T* x, const T* y, const T* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask, std::size_t begin, double* lanes)
+{
+    const T nx = normal.x, ny = normal.y, nz = normal.z, vd = d, eps = epsilon;
+    std::size_t count = 0;
+    for (std::size_t i = begin ; i < n ; ++i)
+    {
+        T diff = x[i] * nx + y[i] * ny + z[i] * nz + vd;
+        T sq = diff * diff;
+        bool inlier = sq <= eps;
+        mask[i] = inlier;
+        if (inlier)
+        {
+            ++count;
+            lanes[i % Lanes] += sq;
+        }
+    }
+    return count;
+}
+
+template <typename T>
+PLANE_KERNELS_INLINE void squaredErrorScalar(const T* x, const T* y, const T* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask, std::size_t begin, double* lanes)
+{
+    const T nx = normal.x, ny = normal.y, nz = normal.z, vd = d;
+    for (std::size_t i = begin ; i < n ; ++i)
+    {
+        if (mask[i])
+        {
+            T diff = x[i] * nx + y[i] * ny + z[i] * nz + vd;
+            lanes[i % Lanes] += diff * diff;
+        }
+    }
+}
+
+template <typename T>
+PLANE_KERNELS_INLINE void projectScalar(T* x, T* y, T* z, std::size_t n, const Vec3d& normal, double d, std::size_t begin)
+{
+    const T nx = normal.x, ny = normal.y, nz = normal.z, vd = d;
+    for (std::size_t i = begin ; i < n ; ++i)
+    {
+        T diff = x[i] * nx + y[i] * ny + z[i] * nz + vd;
+        x[i] -= diff * nx;
+        y[i] -= diff * ny;
+        z[i] -= diff * nz;
+    }
+}
+
+template <typename T>
+PLANE_KERNELS_INLINE void projectIndexedScalar(T* x, T* y, T* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d, std::size_t begin)
+{
+    const T nx = normal.x, ny = normal.y, nz = normal.z, vd = d;
+    for (std::size_t k = begin ; k < n ; ++k)
+    {
+        PointIndex i = indices[k];
+        T diff = x[i] * nx + y[i] * ny + z[i] * nz + vd;
+        x[i] -= diff * nx;
+        y[i] -= diff * ny;
+        z[i] -= diff * nz;
+    }
+}
+
+PLANE_KERNELS_INLINE std::size_t agreeScalar(const float* nx, const float* ny, const float* nz, std::size_t n, const Vec3d& normal, double minCos, unsigned char* mask, std::size_t begin)
+{
+    const float ax = normal.x, ay = normal.y, az = normal.z, c = minCos;
+    std::size_t count = 0;
+    for (std::size_t i = begin ; i < n ; ++i)
+    {
+        float dot = nx[i] * ax + ny[i] * ay + nz[i] * az;
+        bool keep = mask[i] && std::abs(dot) >= c;
+        mask[i] = keep;
+        count += keep;
+    }
+    return count;
+}
+
+#ifdef PLANE_KERNELS_X86
+
+// The 4 bits of the index spread to 4 bytes.
+const std::uint32_t spreadBits[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+
+// Number of bits set in the index, without relying on the popcnt instruction.
+const unsigned char bitCount[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+PlaneKernels::Score classifySse2(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    const __m128d nx = _mm_set1_pd(normal.x), ny = _mm_set1_pd(normal.y), nz = _mm_set1_pd(normal.z);
+    const __m128d vd = _mm_set1_pd(d), eps = _mm_set1_pd(epsilon);
+    // Sums 0 and 1, then 2 and 3.
+    __m128d error[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        for (int h = 0 ; h < 2 ; ++h)
+        {
+            const std::size_t j = i + 2 * h;
+            __m128d diff = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_loadu_pd(x + j), nx), _mm_mul_pd(_mm_loadu_pd(y + j), ny)), _mm_mul_pd(_mm_loadu_pd(z + j), nz)), vd);
+            __m128d sq = _mm_mul_pd(diff, diff);
+            __m128d in = _mm_cmple_pd(sq, eps);
+            int bits = _mm_movemask_pd(in);
+            mask[j] = bits & 1;
+            mask[j + 1] = bits >> 1;
+            count += (bits & 1) + (bits >> 1);
+            error[h] = _mm_add_pd(error[h], _mm_and_pd(in, sq));
+        }
+    }
+
+    double lanes[Lanes];
+    _mm_storeu_pd(lanes, error[0]);
+    _mm_storeu_pd(lanes + 2, error[1]);
+    count += classifyScalar(x, y, z, n, normal, d, epsilon, mask, i, lanes);
+    return PlaneKernels::Score{count, laneTotal(lanes)};
+}
+
+double squaredErrorSse2(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    const __m128d nx = _mm_set1_pd(normal.x), ny = _mm_set1_pd(normal.y), nz = _mm_set1_pd(normal.z);
+    const __m128d vd = _mm_set1_pd(d);
+    // Sums 0 and 1, then 2 and 3.
+    __m128d error[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        for (int h = 0 ; h < 2 ; ++h)
+        {
+            const std::size_t j = i + 2 * h;
+            __m128d diff = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_loadu_pd(x + j), nx), _mm_mul_pd(_mm_loadu_pd(y + j), ny)), _mm_mul_pd(_mm_loadu_pd(z + j), nz)), vd);
+            __m128d selected = _mm_castsi128_pd(_mm_set_epi64x(mask[j + 1] ? -1 : 0, mask[j] ? -1 : 0));
+            error[h] = _mm_add_pd(error[h], _mm_and_pd(selected, _mm_mul_pd(diff, diff)));
+        }
+    }
+
+    double lanes[Lanes];
+    _mm_storeu_pd(lanes, error[0]);
+    _mm_storeu_pd(lanes + 2, error[1]);
+    squaredErrorScalar(x, y, z, n, normal, d, mask, i, lanes);
+    return laneTotal(lanes);
+}
+
+void projectSse2(double* x, double* y, double* z, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m128d nx = _mm_set1_pd(normal.x), ny = _mm_set1_pd(normal.y), nz = _mm_set1_pd(normal.z);
+    const __m128d vd = _mm_set1_pd(d);
+
+    std::size_t i = 0;
+    for ( ; i + 2 <= n ; i += 2)
+    {
+        __m128d px = _mm_loadu_pd(x + i), py = _mm_loadu_pd(y + i), pz = _mm_loadu_pd(z + i);
+        __m128d diff = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(px, nx), _mm_mul_pd(py, ny)), _mm_mul_pd(pz, nz)), vd);
+        _mm_storeu_pd(x + i, _mm_sub_pd(px, _mm_mul_pd(diff, nx)));
+        _mm_storeu_pd(y + i, _mm_sub_pd(py, _mm_mul_pd(diff, ny)));
+        _mm_storeu_pd(z + i, _mm_sub_pd(pz, _mm_mul_pd(diff, nz)));
+    }
+    projectScalar(x, y, z, n, normal, d, i);
+}
+
+void projectIndexedSse2(double* x, double* y, double* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m128d nx = _mm_set1_pd(normal.x), ny = _mm_set1_pd(normal.y), nz = _mm_set1_pd(normal.z);
+    const __m128d vd = _mm_set1_pd(d);
+
+    std::size_t k = 0;
+    for ( ; k + 2 <= n ; k += 2)
+    {
+        PointIndex i0 = indices[k], i1 = indices[k + 1];
+        __m128d px = _mm_set_pd(x[i1], x[i0]), py = _mm_set_pd(y[i1], y[i0]), pz = _mm_set_pd(z[i1], z[i0]);
+        __m128d diff = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(px, nx), _mm_mul_pd(py, ny)), _mm_mul_pd(pz, nz)), vd);
+        px = _mm_sub_pd(px, _mm_mul_pd(diff, nx));
+        py = _mm_sub_pd(py, _mm_mul_pd(diff, ny));
+        pz = _mm_sub_pd(pz, _mm_mul_pd(diff, nz));
+        _mm_storel_pd(x + i0, px);
+        _mm_storeh_pd(x + i1, px);
+        _mm_storel_pd(y + i0, py);
+        _mm_storeh_pd(y + i1, py);
+        _mm_storel_pd(z + i0, pz);
+        _mm_storeh_pd(z + i1, pz);
+    }
+    projectIndexedScalar(x, y, z, indices, n, normal, d, k);
+}
+
+__attribute__((target("avx2")))
+PlaneKernels::Score classifyAvx2(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y), nz = _mm256_set1_pd(normal.z);
+    const __m256d vd = _mm256_set1_pd(d), eps = _mm256_set1_pd(epsilon);
+    __m256d error = _mm256_setzero_pd();
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m256d diff = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(x + i), nx), _mm256_mul_pd(_mm256_loadu_pd(y + i), ny)), _mm256_mul_pd(_mm256_loadu_pd(z + i), nz)), vd);
+        __m256d sq = _mm256_mul_pd(diff, diff);
+        __m256d in = _mm256_cmp_pd(sq, eps, _CMP_LE_OQ);
+        int bits = _mm256_movemask_pd(in);
+        __builtin_memcpy(mask + i, &spreadBits[bits], 4);
+        count += bitCount[bits];
+        error = _mm256_add_pd(error, _mm256_and_pd(in, sq));
+    }
+
+    double lanes[Lanes];
+    _mm256_storeu_pd(lanes, error);
+    count += classifyScalar(x, y, z, n, normal, d, epsilon, mask, i, lanes);
+    return PlaneKernels::Score{count, laneTotal(lanes)};
+}
+
+__attribute__((target("avx2")))
+double squaredErrorAvx2(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y), nz = _mm256_set1_pd(normal.z);
+    const __m256d vd = _mm256_set1_pd(d);
+    __m256d error = _mm256_setzero_pd();
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m256d diff = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(x + i), nx), _mm256_mul_pd(_mm256_loadu_pd(y + i), ny)), _mm256_mul_pd(_mm256_loadu_pd(z + i), nz)), vd);
+        std::uint32_t bytes;
+        __builtin_memcpy(&bytes, mask + i, 4);
+        // One 64-bit lane per mask byte, all ones if the byte is set.
+        __m256i selected = _mm256_cmpgt_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)), _mm256_setzero_si256());
+        error = _mm256_add_pd(error, _mm256_and_pd(_mm256_castsi256_pd(selected), _mm256_mul_pd(diff, diff)));
+    }
+
+    double lanes[Lanes];
+    _mm256_storeu_pd(lanes, error);
+    squaredErrorScalar(x, y, z, n, normal, d, mask, i, lanes);
+    return laneTotal(lanes);
+}
+
+__attribute__((target("avx2")))
+void projectAvx2(double* x, double* y, double* z, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y), nz = _mm256_set1_pd(normal.z);
+    const __m256d vd = _mm256_set1_pd(d);
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m256d px = _mm256_loadu_pd(x + i), py = _mm256_loadu_pd(y + i), pz = _mm256_loadu_pd(z + i);
+        __m256d diff = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, nx), _mm256_mul_pd(py, ny)), _mm256_mul_pd(pz, nz)), vd);
+        _mm256_storeu_pd(x + i, _mm256_sub_pd(px, _mm256_mul_pd(diff, nx)));
+        _mm256_storeu_pd(y + i, _mm256_sub_pd(py, _mm256_mul_pd(diff, ny)));
+        _mm256_storeu_pd(z + i, _mm256_sub_pd(pz, _mm256_mul_pd(diff, nz)));
+    }
+    projectScalar(x, y, z, n, normal, d, i);
+}
+
+// Points are gathered 4 at a time. There is no scatter in AVX2, they are stored one by one.
+__attribute__((target("avx2")))
+void projectIndexedAvx2(double* x, double* y, double* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m256d nx = _mm256_set1_pd(normal.x), ny = _mm256_set1_pd(normal.y), nz = _mm256_set1_pd(normal.z);
+    const __m256d vd = _mm256_set1_pd(d);
+
+    std::size_t k = 0;
+    for ( ; k + 4 <= n ; k += 4)
+    {
+        __m256i offsets = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + k)));
+        __m256d px = _mm256_i64gather_pd(x, offsets, 8), py = _mm256_i64gather_pd(y, offsets, 8), pz = _mm256_i64gather_pd(z, offsets, 8);
+        __m256d diff = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, nx), _mm256_mul_pd(py, ny)), _mm256_mul_pd(pz, nz)), vd);
+        double rx[4], ry[4], rz[4];
+        _mm256_storeu_pd(rx, _mm256_sub_pd(px, _mm256_mul_pd(diff, nx)));
+        _mm256_storeu_pd(ry, _mm256_sub_pd(py, _mm256_mul_pd(diff, ny)));
+        _mm256_storeu_pd(rz, _mm256_sub_pd(pz, _mm256_mul_pd(diff, nz)));
+        for (int j = 0 ; j < 4 ; ++j)
+        {
+            PointIndex i = indices[k + j];
+            x[i] = rx[j];
+            y[i] = ry[j];
+            z[i] = rz[j];
+        }
+    }
+    projectIndexedScalar(x, y, z, indices, n, normal, d, k);
+}
+
+// Float variants: 4 points per SSE2 vector and 8 per AVX2 one. Distances are computed in
+// float like the scalar loops, squared errors are summed in double.
+
+PlaneKernels::Score classifySse2(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    const __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    const __m128 vd = _mm_set1_ps(d), eps = _mm_set1_ps(epsilon);
+    // Sums 0 and 1, then 2 and 3.
+    __m128d error[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m128 diff = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), nx), _mm_mul_ps(_mm_loadu_ps(y + i), ny)), _mm_mul_ps(_mm_loadu_ps(z + i), nz)), vd);
+        __m128 sq = _mm_mul_ps(diff, diff);
+        __m128 in = _mm_cmple_ps(sq, eps);
+        int bits = _mm_movemask_ps(in);
+        __builtin_memcpy(mask + i, &spreadBits[bits], 4);
+        count += bitCount[bits];
+        __m128 selected = _mm_and_ps(in, sq);
+        error[0] = _mm_add_pd(error[0], _mm_cvtps_pd(selected));
+        error[1] = _mm_add_pd(error[1], _mm_cvtps_pd(_mm_movehl_ps(selected, selected)));
+    }
+
+    double lanes[Lanes];
+    _mm_storeu_pd(lanes, error[0]);
+    _mm_storeu_pd(lanes + 2, error[1]);
+    count += classifyScalar(x, y, z, n, normal, d, epsilon, mask, i, lanes);
+    return PlaneKernels::Score{count, laneTotal(lanes)};
+}
+
+double squaredErrorSse2(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    const __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    const __m128 vd = _mm_set1_ps(d);
+    const __m128i zero = _mm_setzero_si128();
+    // Sums 0 and 1, then 2 and 3.
+    __m128d error[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m128 diff = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), nx), _mm_mul_ps(_mm_loadu_ps(y + i), ny)), _mm_mul_ps(_mm_loadu_ps(z + i), nz)), vd);
+        std::uint32_t bytes;
+        __builtin_memcpy(&bytes, mask + i, 4);
+        // One 32-bit lane per mask byte, all ones if the byte is set.
+        __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        __m128 selected = _mm_and_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(wide, zero)), _mm_mul_ps(diff, diff));
+        error[0] = _mm_add_pd(error[0], _mm_cvtps_pd(selected));
+        error[1] = _mm_add_pd(error[1], _mm_cvtps_pd(_mm_movehl_ps(selected, selected)));
+    }
+
+    double lanes[Lanes];
+    _mm_storeu_pd(lanes, error[0]);
+    _mm_storeu_pd(lanes + 2, error[1]);
+    squaredErrorScalar(x, y, z, n, normal, d, mask, i, lanes);
+    return laneTotal(lanes);
+}
+
+void projectSse2(float* x, float* y, float* z, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    const __m128 vd = _mm_set1_ps(d);
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+        __m128 diff = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, nx), _mm_mul_ps(py, ny)), _mm_mul_ps(pz, nz)), vd);
+        _mm_storeu_ps(x + i, _mm_sub_ps(px, _mm_mul_ps(diff, nx)));
+        _mm_storeu_ps(y + i, _mm_sub_ps(py, _mm_mul_ps(diff, ny)));
+        _mm_storeu_ps(z + i, _mm_sub_ps(pz, _mm_mul_ps(diff, nz)));
+    }
+    projectScalar(x, y, z, n, normal, d, i);
+}
+
+void projectIndexedSse2(float* x, float* y, float* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    const __m128 vd = _mm_set1_ps(d);
+
+    std::size_t k = 0;
+    for ( ; k + 4 <= n ; k += 4)
+    {
+        const PointIndex* i = indices + k;
+        __m128 px = _mm_set_ps(x[i[3]], x[i[2]], x[i[1]], x[i[0]]);
+        __m128 py = _mm_set_ps(y[i[3]], y[i[2]], y[i[1]], y[i[0]]);
+        __m128 pz = _mm_set_ps(z[i[3]], z[i[2]], z[i[1]], z[i[0]]);
+        __m128 diff = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, nx), _mm_mul_ps(py, ny)), _mm_mul_ps(pz, nz)), vd);
+        float rx[4], ry[4], rz[4];
+        _mm_storeu_ps(rx, _mm_sub_ps(px, _mm_mul_ps(diff, nx)));
+        _mm_storeu_ps(ry, _mm_sub_ps(py, _mm_mul_ps(diff, ny)));
+        _mm_storeu_ps(rz, _mm_sub_ps(pz, _mm_mul_ps(diff, nz)));
+        for (int j = 0 ; j < 4 ; ++j)
+        {
+            x[i[j]] = rx[j];
+            y[i[j]] = ry[j];
+            z[i[j]] = rz[j];
+        }
+    }
+    projectIndexedScalar(x, y, z, indices, n, normal, d, k);
+}
+
+std::size_t agreeSse2(const float* nx, const float* ny, const float* nz, std::size_t n, const Vec3d& normal, double minCos, unsigned char* mask)
+{
+    const __m128 ax = _mm_set1_ps(normal.x), ay = _mm_set1_ps(normal.y), az = _mm_set1_ps(normal.z);
+    const __m128 c = _mm_set1_ps(minCos), sign = _mm_set1_ps(-0.0f);
+    const __m128i zero = _mm_setzero_si128();
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 4 <= n ; i += 4)
+    {
+        __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(nx + i), ax), _mm_mul_ps(_mm_loadu_ps(ny + i), ay)), _mm_mul_ps(_mm_loadu_ps(nz + i), az));
+        std::uint32_t bytes;
+        __builtin_memcpy(&bytes, mask + i, 4);
+        __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        __m128 keep = _mm_and_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(wide, zero)), _mm_cmpge_ps(_mm_andnot_ps(sign, dot), c));
+        int bits = _mm_movemask_ps(keep);
+        __builtin_memcpy(mask + i, &spreadBits[bits], 4);
+        count += bitCount[bits];
+    }
+    return count + agreeScalar(nx, ny, nz, n, normal, minCos, mask, i);
+}
+
+// Add 8 squared errors to the 4 sums, the first 4 points before the last 4.
+__attribute__((target("avx2")))
+inline __m256d sumToDouble(__m256d error, __m256 selected)
+{
+    return _mm256_add_pd(_mm256_add_pd(error, _mm256_cvtps_pd(_mm256_castps256_ps128(selected))), _mm256_cvtps_pd(_mm256_extractf128_ps(selected, 1)));
+}
+
+__attribute__((target("avx2")))
+PlaneKernels::Score classifyAvx2(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    const __m256 nx = _mm256_set1_ps(normal.x), ny = _mm256_set1_ps(normal.y), nz = _mm256_set1_ps(normal.z);
+    const __m256 vd = _mm256_set1_ps(d), eps = _mm256_set1_ps(epsilon);
+    __m256d error = _mm256_setzero_pd();
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 8 <= n ; i += 8)
+    {
+        __m256 diff = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), nx), _mm256_mul_ps(_mm256_loadu_ps(y + i), ny)), _mm256_mul_ps(_mm256_loadu_ps(z + i), nz)), vd);
+        __m256 sq = _mm256_mul_ps(diff, diff);
+        __m256 in = _mm256_cmp_ps(sq, eps, _CMP_LE_OQ);
+        int bits = _mm256_movemask_ps(in);
+        __builtin_memcpy(mask + i, &spreadBits[bits & 15], 4);
+        __builtin_memcpy(mask + i + 4, &spreadBits[bits >> 4], 4);
+        count += bitCount[bits & 15] + bitCount[bits >> 4];
+        error = sumToDouble(error, _mm256_and_ps(in, sq));
+    }
+
+    double lanes[Lanes];
+    _mm256_storeu_pd(lanes, error);
+    count += classifyScalar(x, y, z, n, normal, d, epsilon, mask, i, lanes);
+    return PlaneKernels::Score{count, laneTotal(lanes)};
+}
+
+__attribute__((target("avx2")))
+double squaredErrorAvx2(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    const __m256 nx = _mm256_set1_ps(normal.x), ny = _mm256_set1_ps(normal.y), nz = _mm256_set1_ps(normal.z);
+    const __m256 vd = _mm256_set1_ps(d);
+    __m256d error = _mm256_setzero_pd();
+
+    std::size_t i = 0;
+    for ( ; i + 8 <= n ; i += 8)
+    {
+        __m256 diff = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), nx), _mm256_mul_ps(_mm256_loadu_ps(y + i), ny)), _mm256_mul_ps(_mm256_loadu_ps(z + i), nz)), vd);
+        // One 32-bit lane per mask byte, all ones if the byte is set.
+        __m256i selected = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + i))), _mm256_setzero_si256());
+        error = sumToDouble(error, _mm256_and_ps(_mm256_castsi256_ps(selected), _mm256_mul_ps(diff, diff)));
+    }
+
+    double lanes[Lanes];
+    _mm256_storeu_pd(lanes, error);
+    squaredErrorScalar(x, y, z, n, normal, d, mask, i, lanes);
+    return laneTotal(lanes);
+}
+
+__attribute__((target("avx2")))
+void projectAvx2(float* x, float* y, float* z, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m256 nx = _mm256_set1_ps(normal.x), ny = _mm256_set1_ps(normal.y), nz = _mm256_set1_ps(normal.z);
+    const __m256 vd = _mm256_set1_ps(d);
+
+    std::size_t i = 0;
+    for ( ; i + 8 <= n ; i += 8)
+    {
+        __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+        __m256 diff = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, nx), _mm256_mul_ps(py, ny)), _mm256_mul_ps(pz, nz)), vd);
+        _mm256_storeu_ps(x + i, _mm256_sub_ps(px, _mm256_mul_ps(diff, nx)));
+        _mm256_storeu_ps(y + i, _mm256_sub_ps(py, _mm256_mul_ps(diff, ny)));
+        _mm256_storeu_ps(z + i, _mm256_sub_ps(pz, _mm256_mul_ps(diff, nz)));
+    }
+    projectScalar(x, y, z, n, normal, d, i);
+}
+
+// Gather 8 floats, whose indices are widened to 64 bits as in the double variant, so that
+// all of them are valid offsets.
+__attribute__((target("avx2")))
+inline __m256 gather(const float* base, __m256i low, __m256i high)
+{
+    return _mm256_set_m128(_mm256_i64gather_ps(base, high, 4), _mm256_i64gather_ps(base, low, 4));
+}
+
+__attribute__((target("avx2")))
+void projectIndexedAvx2(float* x, float* y, float* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    const __m256 nx = _mm256_set1_ps(normal.x), ny = _mm256_set1_ps(normal.y), nz = _mm256_set1_ps(normal.z);
+    const __m256 vd = _mm256_set1_ps(d);
+
+    std::size_t k = 0;
+    for ( ; k + 8 <= n ; k += 8)
+    {
+        __m256i low = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + k)));
+        __m256i high = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + k + 4)));
+        __m256 px = gather(x, low, high), py = gather(y, low, high), pz = gather(z, low, high);
+        __m256 diff = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, nx), _mm256_mul_ps(py, ny)), _mm256_mul_ps(pz, nz)), vd);
+        float rx[8], ry[8], rz[8];
+        _mm256_storeu_ps(rx, _mm256_sub_ps(px, _mm256_mul_ps(diff, nx)));
+        _mm256_storeu_ps(ry, _mm256_sub_ps(py, _mm256_mul_ps(diff, ny)));
+        _mm256_storeu_ps(rz, _mm256_sub_ps(pz, _mm256_mul_ps(diff, nz)));
+        for (int j = 0 ; j < 8 ; ++j)
+        {
+            PointIndex i = indices[k + j];
+            x[i] = rx[j];
+            y[i] = ry[j];
+            z[i] = rz[j];
+        }
+    }
+    projectIndexedScalar(x, y, z, indices, n, normal, d, k);
+}
+
+
+__attribute__((target("avx2")))
+std::size_t agreeAvx2(const float* nx, const float* ny, const float* nz, std::size_t n, const Vec3d& normal, double minCos, unsigned char* mask)
+{
+    const __m256 ax = _mm256_set1_ps(normal.x), ay = _mm256_set1_ps(normal.y), az = _mm256_set1_ps(normal.z);
+    const __m256 c = _mm256_set1_ps(minCos), sign = _mm256_set1_ps(-0.0f);
+    std::size_t count = 0;
+
+    std::size_t i = 0;
+    for ( ; i + 8 <= n ; i += 8)
+    {
+        __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(nx + i), ax), _mm256_mul_ps(_mm256_loadu_ps(ny + i), ay)), _mm256_mul_ps(_mm256_loadu_ps(nz + i), az));
+        __m256i selected = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + i))), _mm256_setzero_si256());
+        __m256 keep = _mm256_and_ps(_mm256_castsi256_ps(selected), _mm256_cmp_ps(_mm256_andnot_ps(sign, dot), c, _CMP_GE_OQ));
+        int bits = _mm256_movemask_ps(keep);
+        __builtin_memcpy(mask + i, &spreadBits[bits & 15], 4);
+        __builtin_memcpy(mask + i + 4, &spreadBits[bits >> 4], 4);
+        count += bitCount[bits & 15] + bitCount[bits >> 4];
+    }
+    return count + agreeScalar(nx, ny, nz, n, normal, minCos, mask, i);
+}
+
+#endif
+
+bool supported(PlaneKernels::Isa isa)
+{
+#ifdef PLANE_KERNELS_X86
+    switch (isa)
+    {
+    case PlaneKernels::Scalar: return true;
+    case PlaneKernels::Sse2: return __builtin_cpu_supports("sse2");
+    case PlaneKernels::Avx2: return __builtin_cpu_supports("avx2");
+    }
+    return false;
+#else
+    return isa == PlaneKernels::Scalar;
+#endif
+}
+
+std::atomic<int>& currentIsa()
+{
+    static std::atomic<int> isa(PlaneKernels::bestIsa());
+    return isa;
+}
+
+}
+
+PlaneKernels::Isa PlaneKernels::bestIsa()
+{
+    if (supported(Avx2))
+        return Avx2;
+    if (supported(Sse2))
+        return Sse2;
+    return Scalar;
+}
+
+PlaneKernels::Isa PlaneKernels::isa()
+{
+    return Isa(currentIsa().load(std::memory_order_relaxed));
+}
+
+PlaneKernels::Isa PlaneKernels::setIsa(Isa isa)
+{
+    if (supported(isa))
+        currentIsa() = isa;
+    return PlaneKernels::isa();
+}
+
+const char* PlaneKernels::isaName(Isa isa)
+{
+    switch (isa)
+    {
+    case Scalar: return "scalar";
+    case Sse2: return "sse2";
+    case Avx2: return "avx2";
+    }
+    return "unknown";
+}
+
+namespace {
+
+template <typename T>
+PlaneKernels::Score classify(const T* x, const T* y, const T* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    switch (PlaneKernels::isa())
+    {
+#ifdef PLANE_KERNELS_X86
+    case PlaneKernels::Avx2: return classifyAvx2(x, y, z, n, normal, d, epsilon, mask);
+    case PlaneKernels::Sse2: return classifySse2(x, y, z, n, normal, d, epsilon, mask);
+#endif
+    default:
+    {
+        double lanes[Lanes] = {0, 0, 0, 0};
+        std::size_t count = classifyScalar(x, y, z, n, normal, d, epsilon, mask, 0, lanes);
+        return PlaneKernels::Score{count, laneTotal(lanes)};
+    }
+    }
+}
+
+template <typename T>
+double squaredError(const T* x, const T* y, const T* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    switch (PlaneKernels::isa())
+    {
+#ifdef PLANE_KERNELS_X86
+    case PlaneKernels::Avx2: return squaredErrorAvx2(x, y, z, n, normal, d, mask);
+    case PlaneKernels::Sse2: return squaredErrorSse2(x, y, z, n, normal, d, mask);
+#endif
+    default:
+    {
+        double lanes[Lanes] = {0, 0, 0, 0};
+        squaredErrorScalar(x, y, z, n, normal, d, mask, 0, lanes);
+        return laneTotal(lanes);
+    }
+    }
+}
+
+template <typename T>
+void project(T* x, T* y, T* z, std::size_t n, const Vec3d& normal, double d)
+{
+    switch (PlaneKernels::isa())
+    {
+#ifdef PLANE_KERNELS_X86
+    case PlaneKernels::Avx2: return projectAvx2(x, y, z, n, normal, d);
+    case PlaneKernels::Sse2: return projectSse2(x, y, z, n, normal, d);
+#endif
+    default: return projectScalar(x, y, z, n, normal, d, 0);
+    }
+}
+
+template <typename T>
+void projectIndexed(T* x, T* y, T* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    switch (PlaneKernels::isa())
+    {
+#ifdef PLANE_KERNELS_X86
+    case PlaneKernels::Avx2: return projectIndexedAvx2(x, y, z, indices, n, normal, d);
+    case PlaneKernels::Sse2: return projectIndexedSse2(x, y, z, indices, n, normal, d);
+#endif
+    default: return projectIndexedScalar(x, y, z, indices, n, normal, d, 0);
+    }
+}
+
+}
+
+PlaneKernels::Score PlaneKernels::classify(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    return ::classify(x, y, z, n, normal, d, epsilon, mask);
+}
+
+PlaneKernels::Score PlaneKernels::classify(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, double epsilon, unsigned char* mask)
+{
+    return ::classify(x, y, z, n, normal, d, epsilon, mask);
+}
+
+double PlaneKernels::squaredError(const double* x, const double* y, const double* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    return ::squaredError(x, y, z, n, normal, d, mask);
+}
+
+double PlaneKernels::squaredError(const float* x, const float* y, const float* z, std::size_t n, const Vec3d& normal, double d, const unsigned char* mask)
+{
+    return ::squaredError(x, y, z, n, normal, d, mask);
+}
+
+void PlaneKernels::project(double* x, double* y, double* z, std::size_t n, const Vec3d& normal, double d)
+{
+    ::project(x, y, z, n, normal, d);
+}
+
+void PlaneKernels::project(float* x, float* y, float* z, std::size_t n, const Vec3d& normal, double d)
+{
+    ::project(x, y, z, n, normal, d);
+}
+
+void PlaneKernels::project(double* x, double* y, double* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    projectIndexed(x, y, z, indices, n, normal, d);
+}
+
+void PlaneKernels::project(float* x, float* y, float* z, const PointIndex* indices, std::size_t n, const Vec3d& normal, double d)
+{
+    projectIndexed(x, y, z, indices, n, normal, d);
+}
+
+std::size_t PlaneKernels::agree(const float* nx, const float* ny, const float* nz, std::size_t n, const Vec3d& normal, double minCos, unsigned char* mask)
+{
+    switch (isa())
+    {
+#ifdef PLANE_KERNELS_X86
+    case Avx2: return agreeAvx2(nx, ny, nz, n, normal, minCos, mask);
+    case Sse2: return agreeSse2(nx, ny, nz, n, normal, minCos, mask);
+#endif
+    default: return agreeScalar(nx, ny, nz, n, normal, minCos, mask, 0);
+    }
+}
@@ -1,60 +1,637 @@
 #include "Ply.h"
 #include "PointCloud.h"
+#include "MappedFile.h"
+#include "Metrics.h"
+#include "TaskScheduler.h"
 
+#include <charconv>
 #include <fstream>
+#include <sstream>
 #include <numeric>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <functional>
+#include <limits>
 
-void Ply::read(const std::string& filename, PointCloud& cloud)
+namespace {
+
+const bool hostIsLittleEndian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+template <typename T>
+inline T load(const char* p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+inline void store(char* p, T value)
 {
-    std::ifstream infile(filename.c_str());
-    std::string line;
-    bool start = false;
-    while (std::getline(infile, line))
+    std::memcpy(p, &value, sizeof(T));
+}
+
+inline unsigned char clampColor(double c)
+{
+    return c <= 0 ? 0 : c >= 255 ? 255 : (unsigned char)(c + 0.5);
+}
+
+// Pages of a binary file already decoded are dropped every this many bytes.
+const std::size_t ReleaseStep = 64 << 20;
+// Records of a binary file decoded by one task.
+const std::size_t BinaryGrain = 1 << 14;
+
+// Property of known type at a fixed offset in a binary vertex record, read as double.
+template <typename T>
+struct Field
+{
+    std::size_t offset;
+
+    inline double operator()(const char* record) const
+        {return load<T>(record + offset);}
+};
+
+}
+
+bool Ply::read(const std::string& filename, PointCloud& cloud)
+{
+    TaskScheduler scheduler(1);
+    return this->read(filename, cloud, scheduler);
+}
+
+bool Ply::read(const std::string& filename, PointCloud& cloud, TaskScheduler& scheduler)
+{
+    MappedFile file;
+    Header header;
+    if (!open(filename, file, header))
+        return false;
+
+    bool result;
+    {
+        Metrics::Timer timer("ply_parse");
+        // Coordinates are made relative in double, before they are stored as Coordinate.
+        auto vertex = [&](const Vec3d& p, RGB color) {
+            if (cloud.size() == 0)
+                cloud.setOrigin(PointCloud::originNear(p));
+            cloud.addPoint(Point(p - cloud.origin()), color);
+        };
+        cloud.reserve(cloud.size() + header.vertexCount);
+        if (header.format == BinaryLittleEndian)
+            result = this->readBinary(file, header, cloud, scheduler);
+        else
+            result = this->readAscii(file, header, vertex, scheduler);
+    }
+
+    Metrics::Timer timer("bounding_box");
+    cloud.boundingBox();
+    timer.stop();
+    if (!result)
+        std::cerr << "Cannot read " << filename << std::endl;
+    return result;
+}
+
+bool Ply::read(const std::string& filename, const Vertex& vertex)
+{
+    MappedFile file;
+    Header header;
+    if (!open(filename, file, header))
+        return false;
+
+    TaskScheduler scheduler(1);
+    bool result;
+    if (header.format == BinaryLittleEndian)
+        result = this->readBinary(file, header, vertex);
+    else
+        result = this->readAscii(file, header, vertex, scheduler);
+    if (!result)
+        std::cerr << "Cannot read " << filename << std::endl;
+    return result;
+}
+
+bool Ply::open(const std::string& filename, MappedFile& file, Header& header)
+{
+    if (!file.open(filename) || !parseHeader(file, header))
     {
-        if (start) {
-            std::istringstream iss(line);
-            double x, y, z;
-            unsigned int r, g, b;
-            if (!(iss >> x >> y >> z >> r >> g >> b))
-                break; 
+        std::cerr << "Cannot read " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
 
-            cloud.addPoint(std::make_shared<Point>(x, y, z, RGB(r, g, b)), RGB(r, g, b));
+bool Ply::readAscii(const MappedFile& file, const Header& header, const Vertex& vertex, TaskScheduler& scheduler)
+{
+    const char* data = file.data() + header.dataOffset;
+    const char* end = file.data() + file.size();
+    for (std::size_t i = 0 ; i < header.skipLines && data < end ; ++i)
+    {
+        const char* eol = static_cast<const char*>(std::memchr(data, '\n', end - data));
+        data = eol ? eol + 1 : end;
+    }
+
+    // Pieces of the file cut at line ends, parsed in parallel a batch at a time, so that
+    // the parsed points of a batch only take a bounded amount of memory.
+    struct Chunk
+    {
+        const char* begin;
+        const char* end;
+        std::vector<Vec3d> points;
+        std::vector<RGB> colors;
+        bool valid;
+    };
+    const std::size_t chunkSize = 1 << 20;
+    std::vector<Chunk> chunks(2 * scheduler.threadCount());
+
+    std::size_t remaining = header.vertexCount;
+    while (remaining > 0 && data < end)
+    {
+        std::size_t used = 0;
+        for ( ; used < chunks.size() && data < end ; ++used)
+        {
+            const char* stop = end;
+            if (std::size_t(end - data) > chunkSize)
+            {
+                const char* eol = static_cast<const char*>(std::memchr(data + chunkSize, '\n', end - data - chunkSize));
+                stop = eol ? eol + 1 : end;
+            }
+            chunks[used].begin = data;
+            chunks[used].end = stop;
+            data = stop;
         }
-        if (line.find("end_header") != std::string::npos) {
-            start = true;
+
+        scheduler.parallelFor(0, used, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t c = first ; c < last ; ++c)
+            {
+                Chunk& chunk = chunks[c];
+                chunk.points.clear();
+                chunk.colors.clear();
+                chunk.valid = parseAscii(header, chunk.begin, chunk.end, chunk.points, chunk.colors);
+            }
+        });
+
+        // The vertices may be followed by lines of other elements, which are not vertices.
+        for (std::size_t c = 0 ; c < used && remaining > 0 ; ++c)
+        {
+            std::size_t count = std::min(remaining, chunks[c].points.size());
+            for (std::size_t i = 0 ; i < count ; ++i)
+                vertex(chunks[c].points[i], chunks[c].colors[i]);
+            remaining -= count;
+            if (!chunks[c].valid && remaining > 0)
+                return false;
         }
+        file.release(data - file.data());
     }
+    return remaining == 0;
+}
 
-    cloud.boundingBox();
+bool Ply::parseAscii(const Header& header, const char* begin, const char* end, std::vector<Vec3d>& points, std::vector<RGB>& colors)
+{
+    int xyz[3], ic[3];
+    if (!findPoint(header, xyz, ic))
+        return false;
+
+    const std::size_t count = header.properties.size();
+    std::vector<double> values(count);
+    auto blank = [](char c) {return c == ' ' || c == '\t' || c == '\r';};
+
+    const char* p = begin;
+    while (p < end)
+    {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol)
+            eol = end;
+
+        std::size_t k = 0;
+        for ( ; k < count ; ++k)
+        {
+            while (p < eol && blank(*p))
+                ++p;
+            if (p == eol)
+                break;
+            std::from_chars_result parsed = std::from_chars(p, eol, values[k]);
+            if (parsed.ec != std::errc())
+                return false;
+            p = parsed.ptr;
+        }
+        if (k == 0 && p == eol)
+        {
+            p = eol + 1;
+            continue;
+        }
+        if (k < count)
+            return false;
+
+        RGB color;
+        unsigned char* channels[3] = {&color.r, &color.g, &color.b};
+        for (int c = 0 ; c < 3 ; ++c)
+        {
+            if (ic[c] < 0)
+                continue;
+            Type type = header.properties[ic[c]].type;
+            double value = values[ic[c]];
+            if (type == Float32 || type == Float64)
+                value *= 255;
+            *channels[c] = clampColor(value);
+        }
+        points.push_back(Vec3d(values[xyz[0]], values[xyz[1]], values[xyz[2]]));
+        colors.push_back(color);
+        p = eol + 1;
+    }
+    return true;
+}
+
+bool Ply::readBinary(const MappedFile& file, const Header& header, const Vertex& vertex)
+{
+    int xyz[3], rgb[3];
+    if (!hostIsLittleEndian || !findPoint(header, xyz, rgb)
+        || header.dataOffset + header.skip + header.vertexCount * header.vertexSize > file.size())
+        return false;
+
+    const char* data = file.data() + header.dataOffset + header.skip;
+    const Property& px = header.properties[xyz[0]];
+    const Property& py = header.properties[xyz[1]];
+    const Property& pz = header.properties[xyz[2]];
+
+    // Pages already decoded are dropped so that large files do not stay resident.
+    std::size_t released = 0;
+    for (std::size_t i = 0 ; i < header.vertexCount ; ++i, data += header.vertexSize)
+    {
+        if (std::size_t(data - file.data()) >= released + ReleaseStep)
+        {
+            released = data - file.data();
+            file.release(released);
+        }
+
+        vertex(Vec3d(decode(data + px.offset, px.type),
+                     decode(data + py.offset, py.type),
+                     decode(data + pz.offset, pz.type)), decodeColor(header, rgb, data));
+    }
+    return true;
+}
+
+bool Ply::readBinary(const MappedFile& file, const Header& header, PointCloud& cloud, TaskScheduler& scheduler)
+{
+    int xyz[3], rgb[3];
+    if (!hostIsLittleEndian || !findPoint(header, xyz, rgb)
+        || header.dataOffset + header.skip + header.vertexCount * header.vertexSize > file.size())
+        return false;
+
+    const char* data = file.data() + header.dataOffset + header.skip;
+    const std::size_t n = header.vertexCount;
+    const std::size_t size = header.vertexSize;
+    const PointIndex first = cloud.size();
+    const Property& px = header.properties[xyz[0]];
+    const Property& py = header.properties[xyz[1]];
+    const Property& pz = header.properties[xyz[2]];
+    if (n > 0 && first == 0)
+        cloud.setOrigin(PointCloud::originNear(Vec3d(decode(data + px.offset, px.type), decode(data + py.offset, py.type), decode(data + pz.offset, pz.type))));
+    const Vec3d origin = cloud.origin();
+    cloud.resize(first + n);
+
+    // Batches of records decoded in parallel, each followed by the release of its pages.
+    auto decodeWith = [&](auto readX, auto readY, auto readZ, auto readColor) {
+        const std::size_t batch = std::max<std::size_t>(1, ReleaseStep / std::max<std::size_t>(1, size));
+        for (std::size_t done = 0 ; done < n ; )
+        {
+            const std::size_t end = std::min(n, done + batch);
+            scheduler.parallelFor(done, end, BinaryGrain, [&](std::size_t begin, std::size_t last) {
+                const char* record = data + begin * size;
+                for (std::size_t i = begin ; i < last ; ++i, record += size)
+                {
+                    cloud.mX[first + i] = Coordinate(readX(record) - origin.x);
+                    cloud.mY[first + i] = Coordinate(readY(record) - origin.y);
+                    cloud.mZ[first + i] = Coordinate(readZ(record) - origin.z);
+                    cloud.mRGB[first + i] = readColor(record);
+                }
+            });
+            done = end;
+            file.release(data + done * size - file.data());
+        }
+    };
+
+    // Loops specialised for the usual layouts: float or double coordinates and uchar colors.
+    auto withColor = [&](auto readX, auto readY, auto readZ) {
+        bool bytes = true;
+        for (int c = 0 ; c < 3 ; ++c)
+            bytes = bytes && rgb[c] >= 0 && header.properties[rgb[c]].type == UInt8;
+        if (bytes)
+        {
+            const std::size_t r = header.properties[rgb[0]].offset, g = header.properties[rgb[1]].offset, b = header.properties[rgb[2]].offset;
+            decodeWith(readX, readY, readZ, [=](const char* record) {return RGB(record[r], record[g], record[b]);});
+        }
+        else
+            decodeWith(readX, readY, readZ, [&](const char* record) {return decodeColor(header, rgb, record);});
+    };
+    auto all = [&](Type type) {return px.type == type && py.type == type && pz.type == type;};
+    if (all(Float32))
+        withColor(Field<float>{px.offset}, Field<float>{py.offset}, Field<float>{pz.offset});
+    else if (all(Float64))
+        withColor(Field<double>{px.offset}, Field<double>{py.offset}, Field<double>{pz.offset});
+    else
+    {
+        auto any = [](const Property& p) {return [&p](const char* record) {return decode(record + p.offset, p.type);};};
+        withColor(any(px), any(py), any(pz));
+    }
+
+    cloud.appended(first);
+    return true;
+}
+
+double Ply::decode(const char* p, Type type)
+{
+    switch (type)
+    {
+    case Int8: return load<std::int8_t>(p);
+    case UInt8: return load<std::uint8_t>(p);
+    case Int16: return load<std::int16_t>(p);
+    case UInt16: return load<std::uint16_t>(p);
+    case Int32: return load<std::int32_t>(p);
+    case UInt32: return load<std::uint32_t>(p);
+    case Float32: return load<float>(p);
+    case Float64: return load<double>(p);
+    }
+    return 0;
+}
+
+RGB Ply::decodeColor(const Header& header, const int* rgb, const char* record)
+{
+    RGB color;
+    unsigned char* channels[3] = {&color.r, &color.g, &color.b};
+    for (int c = 0 ; c < 3 ; ++c)
+    {
+        if (rgb[c] < 0)
+            continue;
+        const Property& pc = header.properties[rgb[c]];
+        double value = decode(record + pc.offset, pc.type);
+        if (pc.type == Float32 || pc.type == Float64)
+            value *= 255;
+        *channels[c] = clampColor(value);
+    }
+    return color;
+}
+
+bool Ply::parseHeader(const MappedFile& file, Header& header)
+{
+    header.format = Ascii;
+    header.vertexCount = 0;
+    header.vertexSize = 0;
+    header.skip = 0;
+    header.skipLines = 0;
+    header.properties.clear();
+
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    const char* line = begin;
+
+    std::string element;
+    std::size_t elementCount = 0;
+    std::size_t elementSize = 0;
+    bool hasList = false;
+    bool vertexSeen = false;
+    bool first = true;
+
+    // Account for a finished element that precedes the vertices.
+    auto closeElement = [&]() {
+        if (!element.empty() && element != "vertex" && !vertexSeen)
+        {
+            if (header.format == Ascii)
+                header.skipLines += elementCount;
+            else if (hasList && elementCount > 0)
+                return false;
+            else
+                header.skip += elementCount * elementSize;
+        }
+        if (element == "vertex")
+            vertexSeen = true;
+        return true;
+    };
+
+    while (line < end)
+    {
+        const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!eol)
+            return false;
+        std::string text(line, eol);
+        if (!text.empty() && text.back() == '\r')
+            text.pop_back();
+        line = eol + 1;
+
+        std::istringstream iss(text);
+        std::string keyword;
+        iss >> keyword;
+
+        if (first)
+        {
+            if (keyword != "ply")
+                return false;
+            first = false;
+        }
+        else if (keyword == "format")
+        {
+            std::string format;
+            iss >> format;
+            if (format == "ascii")
+                header.format = Ascii;
+            else if (format == "binary_little_endian")
+                header.format = BinaryLittleEndian;
+            else
+                return false;
+        }
+        else if (keyword == "element")
+        {
+            if (!closeElement())
+                return false;
+            iss >> element >> elementCount;
+            elementSize = 0;
+            hasList = false;
+            if (element == "vertex")
+                header.vertexCount = elementCount;
+        }
+        else if (keyword == "property")
+        {
+            std::string typeName, name;
+            iss >> typeName;
+            if (typeName == "list")
+            {
+                // Variable size records cannot be skipped without parsing.
+                if (element == "vertex")
+                    return false;
+                hasList = true;
+                continue;
+            }
+            Type type;
+            if (!(iss >> name) || !parseType(typeName, type))
+                return false;
+            if (element == "vertex")
+            {
+                Property property = {name, type, header.vertexSize};
+                header.properties.push_back(property);
+                header.vertexSize += typeSize(type);
+            }
+            else
+                elementSize += typeSize(type);
+        }
+        else if (keyword == "end_header")
+        {
+            if (!closeElement())
+                return false;
+            header.dataOffset = line - begin;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Ply::parseType(const std::string& name, Type& type)
+{
+    if (name == "char" || name == "int8")
+        type = Int8;
+    else if (name == "uchar" || name == "uint8")
+        type = UInt8;
+    else if (name == "short" || name == "int16")
+        type = Int16;
+    else if (name == "ushort" || name == "uint16")
+        type = UInt16;
+    else if (name == "int" || name == "int32")
+        type = Int32;
+    else if (name == "uint" || name == "uint32")
+        type = UInt32;
+    else if (name == "float" || name == "float32")
+        type = Float32;
+    else if (name == "double" || name == "float64")
+        type = Float64;
+    else
+        return false;
+    return true;
+}
+
+std::size_t Ply::typeSize(Type type)
+{
+    switch (type)
+    {
+    case Int8: case UInt8: return 1;
+    case Int16: case UInt16: return 2;
+    case Int32: case UInt32: case Float32: return 4;
+    case Float64: return 8;
+    }
+    return 0;
 }
 
-bool Ply::write(const std::string& filename, PointCloud& cloud) 
+int Ply::findProperty(const Header& header, const char* name, const char* alternative)
 {
-    std::ofstream out(filename.c_str());
+    for (unsigned int i = 0 ; i < header.properties.size() ; ++i)
+        if (header.properties[i].name == name || (alternative && header.properties[i].name == alternative))
+            return i;
+    return -1;
+}
+
+bool Ply::findPoint(const Header& header, int* xyz, int* rgb)
+{
+    xyz[0] = findProperty(header, "x");
+    xyz[1] = findProperty(header, "y");
+    xyz[2] = findProperty(header, "z");
+    rgb[0] = findProperty(header, "red", "diffuse_red");
+    rgb[1] = findProperty(header, "green", "diffuse_green");
+    rgb[2] = findProperty(header, "blue", "diffuse_blue");
+    return xyz[0] >= 0 && xyz[1] >= 0 && xyz[2] >= 0;
+}
+
+Ply::Ply() :
+    mDoubleCoordinates(false)
+{
+}
+
+bool Ply::write(const std::string& filename, PointCloud& cloud, Format format)
+{
+    if (format == BinaryLittleEndian && !hostIsLittleEndian)
+    {
+        std::cerr << "Cannot save " << filename << " as little endian on this host" << std::endl;
+        return false;
+    }
+
+    std::ofstream out(filename.c_str(), std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "Cannot save " << filename << std::endl;
         return false;
     }
 
+    bool result = this->writeHeader(out, cloud.size(), format, cloud.origin()) && this->writeVertices(out, cloud, format);
+
+    out.close();
+    if (!result || out.fail()) {
+        std::cerr << "Cannot save " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Ply::writeHeader(std::ostream& out, std::size_t vertexCount, Format format, const Vec3d& origin)
+{
+    mDoubleCoordinates = origin.x != 0 || origin.y != 0 || origin.z != 0;
+    const char* type = mDoubleCoordinates ? "double" : "float";
     out << "ply" << std::endl
-        << "format ascii 1.0" << std::endl
-        << "element vertex " << cloud.points().size() << std::endl
-        << "property float x" << std::endl
-        << "property float y" << std::endl
-        << "property float z" << std::endl
+        << (format == BinaryLittleEndian ? "format binary_little_endian 1.0" : "format ascii 1.0") << std::endl
+        << "element vertex " << vertexCount << std::endl
+        << "property " << type << " x" << std::endl
+        << "property " << type << " y" << std::endl
+        << "property " << type << " z" << std::endl
         << "property uchar red" << std::endl
         << "property uchar green" << std::endl
         << "property uchar blue" << std::endl
         << "end_header" << std::endl;
+    return bool(out);
+}
+
+bool Ply::writeVertices(std::ostream& out, PointCloud& cloud, Format format)
+{
+    if (format == BinaryLittleEndian && !hostIsLittleEndian)
+        return false;
+    return format == BinaryLittleEndian ? this->writeBinary(out, cloud) : this->writeAscii(out, cloud);
+}
 
-    for (SharedPoint p : cloud.points()) {
-        std::pair<RGB, bool> state = cloud.colors().at(p);
-        RGB rgb = p -> color;
-        out << p->x << " " << p->y << " " << p->z << " " << int(rgb.r) << " " << int(rgb.g) << " " << int(rgb.b) << " " << std::endl;
+bool Ply::writeAscii(std::ostream& out, PointCloud& cloud)
+{
+    const Vec3d origin = cloud.origin();
+    // Enough digits to read back the coordinates exactly.
+    const std::streamsize precision = out.precision(mDoubleCoordinates ? std::numeric_limits<double>::max_digits10 : std::numeric_limits<float>::max_digits10);
+    for (PointIndex i = 0 ; i < cloud.size() ; ++i) {
+        RGB rgb = cloud.color(i);
+        out << origin.x + cloud.x()[i] << " " << origin.y + cloud.y()[i] << " " << origin.z + cloud.z()[i] << " " << int(rgb.r) << " " << int(rgb.g) << " " << int(rgb.b) << " " << "\n";
     }
+    out.precision(precision);
+    return true;
+}
 
-    out.close();
+bool Ply::writeBinary(std::ostream& out, PointCloud& cloud)
+{
+    return mDoubleCoordinates ? this->writeBinary<double>(out, cloud) : this->writeBinary<float>(out, cloud);
+}
+
+template <typename T>
+bool Ply::writeBinary(std::ostream& out, PointCloud& cloud)
+{
+    const std::size_t vertexSize = 3 * sizeof(T) + 3;
+    const std::size_t chunk = 1 << 16;
+    std::vector<char> buffer(chunk * vertexSize);
+    const Vec3d origin = cloud.origin();
+
+    for (std::size_t begin = 0 ; begin < cloud.size() ; begin += chunk)
+    {
+        std::size_t end = std::min(cloud.size(), begin + chunk);
+        char* p = buffer.data();
+        for (std::size_t i = begin ; i < end ; ++i, p += vertexSize)
+        {
+            RGB rgb = cloud.color(i);
+            store<T>(p, origin.x + cloud.x()[i]);
+            store<T>(p + sizeof(T), origin.y + cloud.y()[i]);
+            store<T>(p + 2 * sizeof(T), origin.z + cloud.z()[i]);
+            p[3 * sizeof(T)] = rgb.r;
+            p[3 * sizeof(T) + 1] = rgb.g;
+            p[3 * sizeof(T) + 2] = rgb.b;
+        }
+        if (!out.write(buffer.data(), p - buffer.data()))
+            return false;
+    }
     return true;
-}
\ No newline at end of file
+}
@@ -1,7 +1,16 @@
 #include "PointCloud.h"
 
+#include "PlaneKernels.h"
+#include <cmath>
 #include <fstream>
 
+namespace {
+
+// Step of the origins, a power of two so that they are exact.
+const double OriginStep = 1024;
+
+}
+
 PointCloud::PointCloud()
 {
     min = Vec3d(
@@ -16,25 +25,75 @@ PointCloud::PointCloud()
 
 void PointCloud::merge(const PointCloud& other)
 {
-    mCenter *= mPoints.size();
-    for (SharedPoint p : other.mPoints)
-        addPoint(p, other.mColors.at(p).first);
+    mCenter *= size();
+    reserve(size() + other.size());
+    Vec3d shift = other.mOrigin - mOrigin;
+    for (PointIndex i = 0 ; i < other.size() ; ++i)
+        addPoint(Point(Vec3d(other.point(i)) + shift), other.mColors.at(i).first);
     this->boundingBox();
 }
 
+Vec3d PointCloud::originNear(const Vec3d& p)
+{
+    Vec3d origin;
+    for (int a = 0 ; a < 3 ; ++a)
+        if (std::isfinite(p[a]))
+            origin[a] = std::round(p[a] / OriginStep) * OriginStep;
+    return origin;
+}
+
+void PointCloud::reserve(std::size_t n)
+{
+    mX.reserve(n);
+    mY.reserve(n);
+    mZ.reserve(n);
+    mRGB.reserve(n);
+    mColors.reserve(n);
+}
+
+PointIndex PointCloud::addPoint(const Point& p, RGB color)
+{
+    Vec3d q(p);
+    mCenter += q;
+    max.max(q);
+    min.min(q);
 
-void PointCloud::addPoint(SharedPoint p, RGB color)
+    PointIndex i = mX.size();
+    mX.push_back(p.x);
+    mY.push_back(p.y);
+    mZ.push_back(p.z);
+    mRGB.push_back(color);
+    mColors.append(i, std::make_pair(color, false));
+    return i;
+}
+
+void PointCloud::resize(std::size_t n)
 {
-    mCenter += *p;
-    max.max(*p);
-    min.min(*p);
+    mX.resize(n);
+    mY.resize(n);
+    mZ.resize(n);
+    mRGB.resize(n);
+}
 
-    mPoints.push_back(p);
-    mColors.append(p, std::make_pair(color, false));
+void PointCloud::appended(PointIndex first)
+{
+    for (PointIndex i = first ; i < size() ; ++i)
+    {
+        Vec3d q(mX[i], mY[i], mZ[i]);
+        mCenter += q;
+        max.max(q);
+        min.min(q);
+    }
+    mColors.extend(size(), [this](std::size_t i) {return std::make_pair(mRGB[i], false);});
+}
+
+void PointCloud::project(const PointIndex* begin, const PointIndex* end, const Vec3d& normal, double d)
+{
+    PlaneKernels::project(mX.data(), mY.data(), mZ.data(), begin, end - begin, normal, d);
 }
 
 void PointCloud::boundingBox()
 {
-    mCenter /= mPoints.size();
+    mCenter /= size();
     mHalfDimension = (max - min) / 2;
 }
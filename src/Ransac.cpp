@@ -1,18 +1,54 @@
 #include "Ransac.h"
 
-SharedPlane Ransac::ransac(std::vector<SharedPoint>& points, double epsilon, int numStartPoints, int numPoints, int steps, std::default_random_engine& generator, UnionFindPlanes& colors)
+#include "Metrics.h"
+#include "Philox.h"
+#include "PlaneKernels.h"
+#include "TaskScheduler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Hypotheses drawn and scored together in parallel. Fixed, so that the result does not
+// depend on the number of threads.
+const int HypothesesPerBatch = 8;
+// Smaller point sets score their hypotheses one by one on the calling thread, so that
+// each one is taken into account before the next is drawn.
+const std::size_t MinParallelPoints = 1 << 14;
+// Stream of the random subset of preemptive scoring; hypothesis t uses stream t.
+const std::uint64_t SubsetStream = ~std::uint64_t(0);
+// Draws allowed per point of a sample to find points whose normal agrees with the seed.
+const int DrawsPerSamplePoint = 4;
+
+// State of one hypothesis of a batch, reused from batch to batch.
+struct Hypothesis
+{
+    Plane plane;
+    std::vector<PointIndex> pts;
+    std::vector<unsigned char> inliers;
+    std::size_t count;
+    double error;
+    bool preempted;
+    bool rejected;
+};
+
+}
+
+SharedPlane Ransac::ransac(const PointCloud& cloud, std::vector<PointIndex>& points, const DetectionParams& params, std::uint64_t key, UnionFindPlanes& colors, TaskScheduler& scheduler)
 {
     SharedPlane result;
+    const int numStartPoints = params.numStartPoints;
     if (points.size() < numStartPoints || numStartPoints < 3)
         return result;
 
     Vec3d center;
     Vec3d meansq;
 
-    for (auto&& point : points)
+    for (PointIndex i : points)
     {
-        center += *point;
-        meansq += point->cmul(*point);
+        Vec3d point(cloud.point(i));
+        center += point;
+        meansq += point.cmul(point);
     }
 
     center /= points.size();
@@ -22,62 +58,223 @@ SharedPlane Ransac::ransac(std::vector<SharedPoint>& points, double epsilon, int
 
     double radius = std::sqrt(stddev.x + stddev.y + stddev.z);
 
-    epsilon *= radius;
+    double epsilon = params.epsilon * radius;
 
-    std::vector<SharedPoint> result_pts;
-    std::vector<SharedPoint> remaining_pts;
-    double score = -1;
+    // Coordinates of the points, kept in the same order as points.
+    const std::size_t n = points.size();
+    std::vector<Coordinate> x(n), y(n), z(n);
+    for (std::size_t i = 0 ; i < n ; ++i)
+    {
+        x[i] = cloud.x()[points[i]];
+        y[i] = cloud.y()[points[i]];
+        z[i] = cloud.z()[points[i]];
+    }
+
+    // Normals and curvatures of the points, in the same order, if the cloud has them.
+    const bool normals = cloud.hasNormals();
+    std::vector<float> nx, ny, nz, curvature;
+    if (normals)
+    {
+        nx.resize(n);
+        ny.resize(n);
+        nz.resize(n);
+        curvature.resize(n);
+        for (std::size_t i = 0 ; i < n ; ++i)
+        {
+            nx[i] = cloud.normalX()[points[i]];
+            ny[i] = cloud.normalY()[points[i]];
+            nz[i] = cloud.normalZ()[points[i]];
+            curvature[i] = cloud.curvature()[points[i]];
+        }
+    }
+
+    // Random subset to discard poor hypotheses before scoring them on all points.
+    const bool preemptive = params.preemptiveSubset > 0 && std::size_t(params.preemptiveSubset) < n;
+    std::vector<Coordinate> sx, sy, sz;
+    std::vector<float> snx, sny, snz;
+    if (preemptive)
+    {
+        Philox random(key, SubsetStream);
+        for (int i = 0 ; i < params.preemptiveSubset ; ++i)
+        {
+            std::size_t k = random.below(n);
+            sx.push_back(x[k]);
+            sy.push_back(y[k]);
+            sz.push_back(z[k]);
+            if (normals)
+            {
+                snx.push_back(nx[k]);
+                sny.push_back(ny[k]);
+                snz.push_back(nz[k]);
+            }
+        }
+    }
+
+    // Fill pts with a flat seed and points whose normals agree with it, and return false if
+    // there are not enough of them.
+    auto sampleWithNormals = [&](std::vector<PointIndex>& pts, Philox& random, Vec3d& seedNormal) {
+        std::size_t seed = random.below(n);
+        if (curvature[seed] > params.maxCurvature)
+            return false;
+        seedNormal = Vec3d(nx[seed], ny[seed], nz[seed]);
+        pts.push_back(points[seed]);
+        for (int draw = 0 ; draw < DrawsPerSamplePoint * numStartPoints && pts.size() < std::size_t(numStartPoints) ; ++draw)
+        {
+            std::size_t k = random.below(n);
+            if (std::abs(nx[k] * seedNormal.x + ny[k] * seedNormal.y + nz[k] * seedNormal.z) >= params.normalCos
+                    && std::find(pts.begin(), pts.end(), points[k]) == pts.end())
+                pts.push_back(points[k]);
+        }
+        return pts.size() == std::size_t(numStartPoints);
+    };
+
+    // Hypothesis t only depends on its own random stream, and on the best inlier ratio
+    // of the previous batches for preemption.
+    auto evaluate = [&](Hypothesis& h, std::uint64_t t, double bestRatio) {
+        Philox random(key, t);
+        h.pts.clear();
+        h.count = 0;
+        h.preempted = false;
+        h.rejected = false;
+        if (normals)
+        {
+            // The plane of the sample must also agree with the normal of its seed.
+            Vec3d seedNormal;
+            h.rejected = !sampleWithNormals(h.pts, random, seedNormal);
+            if (!h.rejected)
+            {
+                h.plane.setPoints(cloud, h.pts);
+                h.rejected = std::abs(h.plane.normal * seedNormal) < params.normalCos;
+            }
+            if (h.rejected)
+                return;
+        }
+        else
+        {
+            while (h.pts.size() < std::size_t(numStartPoints))
+            {
+                PointIndex p = points[random.below(n)];
+                if (std::find(h.pts.begin(), h.pts.end(), p) == h.pts.end())
+                    h.pts.push_back(p);
+            }
+            h.plane.setPoints(cloud, h.pts);
+        }
 
-    for (int t = 0 ; t < steps ; ++t) {
-        std::vector<SharedPoint> pts;
-        for (int i = 0 ; i < numStartPoints ; ++i) {
-            std::uniform_int_distribution<int> distribution(i, points.size() - 1);
-            int k = distribution(generator);
+        if (preemptive && bestRatio > 0)
+        {
+            std::vector<unsigned char>& subsetInliers = h.inliers;
+            subsetInliers.resize(sx.size());
+            PlaneKernels::Score estimate = PlaneKernels::classify(sx.data(), sy.data(), sz.data(), sx.size(), h.plane.normal, h.plane.d, epsilon, subsetInliers.data());
+            if (normals)
+                estimate.count = PlaneKernels::agree(snx.data(), sny.data(), snz.data(), sx.size(), h.plane.normal, params.normalCos, subsetInliers.data());
+            if (double(estimate.count) / sx.size() < params.preemptiveRatio * bestRatio)
+            {
+                h.preempted = true;
+                return;
+            }
+        }
+
+        h.inliers.resize(n);
+        PlaneKernels::Score match = PlaneKernels::classify(x.data(), y.data(), z.data(), n, h.plane.normal, h.plane.d, epsilon, h.inliers.data());
+        h.count = normals ? PlaneKernels::agree(nx.data(), ny.data(), nz.data(), n, h.plane.normal, params.normalCos, h.inliers.data()) : match.count;
+
+        if (h.count > std::size_t(params.numPoints))
+        {
+            h.pts.clear();
+            for (std::size_t i = 0 ; i < n ; ++i)
+                if (h.inliers[i])
+                    h.pts.push_back(points[i]);
 
-            std::swap(points[i], points[k]);
-            pts.push_back(points[i]);
+            h.plane.setPoints(cloud, h.pts);
+            h.error = PlaneKernels::squaredError(x.data(), y.data(), z.data(), n, h.plane.normal, h.plane.d, h.inliers.data());
         }
+    };
 
-        SharedPlane shared_plane = std::make_shared<Plane>(pts);
-        Plane& plane = *shared_plane;
+    std::vector<Hypothesis> batch(HypothesesPerBatch);
+    std::vector<unsigned char> bestInliers;
+    double score = -1;
+    double bestRatio = 0;
+    int steps = params.steps;
+    int preempted = 0;
+    int rejected = 0;
+    int accepted = 0;
 
-        std::vector<SharedPoint> pts_out;
-        matchPoints(points, plane, epsilon, pts, pts_out);
+    const int batchSize = n >= MinParallelPoints ? HypothesesPerBatch : 1;
+    int t = 0;
+    while (t < steps)
+    {
+        const int size = std::min(batchSize, steps - t);
+        const double ratio = bestRatio;
+        if (size > 1)
+        {
+            scheduler.parallelFor(0, size, 1, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t h = begin ; h < end ; ++h)
+                    evaluate(batch[h], t + h, ratio);
+            });
+        }
+        else
+            evaluate(batch[0], t, ratio);
 
-        if (pts.size() > numPoints)
+        // Take the hypotheses of the batch into account in order.
+        for (int h = 0 ; h < size ; ++h)
         {
-            plane.setPoints(pts);
-            double error = 0;
-            for (auto&& p : pts)
-                error += plane.squareDistance(p);
-            if (score < 0 || error < score)
+            Hypothesis& hypothesis = batch[h];
+            if (hypothesis.preempted)
+            {
+                ++preempted;
+                continue;
+            }
+            if (hypothesis.rejected)
             {
-                result = shared_plane;
-                result_pts = pts;
-                remaining_pts = pts_out;
-                score = error;
+                ++rejected;
+                continue;
+            }
+
+            if (double(hypothesis.count) / n > bestRatio)
+            {
+                bestRatio = double(hypothesis.count) / n;
+                if (params.confidence > 0)
+                    steps = requiredSteps(bestRatio, numStartPoints, params.confidence, params.steps);
+            }
+
+            if (hypothesis.count > std::size_t(params.numPoints))
+            {
+                ++accepted;
+                if (score < 0 || hypothesis.error < score)
+                {
+                    result = std::make_shared<Plane>(hypothesis.plane);
+                    bestInliers.swap(hypothesis.inliers);
+                    score = hypothesis.error;
+                }
             }
         }
+        t += size;
     }
 
-    for (auto&& p : result_pts)
+    Metrics::add(Metrics::HypothesesTried, t);
+    Metrics::add(Metrics::HypothesesPreempted, preempted);
+    Metrics::add(Metrics::HypothesesRejected, rejected);
+    Metrics::add(Metrics::HypothesesAccepted, accepted);
+
+    if (result)
     {
-        colors.merge(p, result_pts[0]);
+        std::vector<PointIndex> result_pts;
+        std::vector<PointIndex> remaining_pts;
+        for (std::size_t i = 0 ; i < n ; ++i)
+            (bestInliers[i] ? result_pts : remaining_pts).push_back(points[i]);
+        result->setMembers(result_pts, colors);
+        points.swap(remaining_pts);
     }
-
-    points = remaining_pts;
     return result;
 }
 
-void Ransac::matchPoints(const std::vector<SharedPoint>& points, Plane& plane, double epsilon, std::vector<SharedPoint>& pts_in, std::vector<SharedPoint>& pts_out)
+int Ransac::requiredSteps(double inlierRatio, int sampleSize, double confidence, int maxSteps)
 {
-    pts_in.clear();
-    pts_out.clear();
-    for (auto&& p : points)
-    {
-        if (plane.squareDistance(p) <= epsilon)
-            pts_in.push_back(p);
-        else
-            pts_out.push_back(p);
-    }
+    double good = std::pow(inlierRatio, sampleSize);
+    if (good >= 1)
+        return 1;
+    if (good <= 0 || confidence >= 1)
+        return maxSteps;
+    double steps = std::ceil(std::log(1 - confidence) / std::log(1 - good));
+    return steps < maxSteps ? std::max(1, int(steps)) : maxSteps;
 }
@@ -0,0 +1,174 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+
+namespace {
+
+// Scheduler and queue of the current worker thread.
+thread_local const TaskScheduler* currentScheduler = nullptr;
+thread_local unsigned int currentIndex = 0;
+
+}
+
+TaskScheduler::Group::Group(TaskScheduler& scheduler) :
+    mScheduler(scheduler), mPending(0)
+{
+}
+
+TaskScheduler::Group::~Group()
+{
+    try
+    {
+        this->wait();
+    }
+    catch (...)
+    {
+    }
+}
+
+void TaskScheduler::Group::run(Task task)
+{
+    ++mPending;
+    mScheduler.push([this, task]() {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mException)
+                mException = std::current_exception();
+        }
+        --mPending;
+    });
+}
+
+void TaskScheduler::Group::wait()
+{
+    while (mPending > 0)
+        if (!mScheduler.runOne())
+            std::this_thread::yield();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mException)
+    {
+        std::exception_ptr e = mException;
+        mException = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+TaskScheduler::TaskScheduler(unsigned int threads) :
+    mQueued(0), mStop(false)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 0 ; i < threads ; ++i)
+        mQueues.push_back(std::unique_ptr<Queue>(new Queue()));
+    for (unsigned int i = 0 ; i + 1 < threads ; ++i)
+        mThreads.push_back(std::thread(&TaskScheduler::worker, this, i));
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_all();
+    for (auto&& thread : mThreads)
+        thread.join();
+}
+
+void TaskScheduler::parallelFor(std::size_t begin, std::size_t end, std::size_t grain, const std::function<void(std::size_t, std::size_t)>& f)
+{
+    if (end <= begin)
+        return;
+    std::size_t chunk = std::max<std::size_t>(grain, (end - begin + 4 * threadCount() - 1) / (4 * threadCount()));
+    if (end - begin <= chunk)
+    {
+        f(begin, end);
+        return;
+    }
+
+    Group group(*this);
+    for (std::size_t b = begin ; b < end ; b += chunk)
+    {
+        std::size_t e = std::min(end, b + chunk);
+        group.run([&f, b, e]() {f(b, e);});
+    }
+    group.wait();
+}
+
+unsigned int TaskScheduler::currentQueue() const
+{
+    return currentScheduler == this ? currentIndex : mQueues.size() - 1;
+}
+
+void TaskScheduler::push(Task task)
+{
+    Queue& queue = *mQueues[this->currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mQueued;
+    }
+    mCondition.notify_one();
+}
+
+bool TaskScheduler::runOne()
+{
+    unsigned int own = this->currentQueue();
+    Task task;
+
+    // Newest task from our own queue, keeps the working set hot.
+    {
+        Queue& queue = *mQueues[own];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+    }
+
+    // Oldest task of another queue, usually the largest piece of work.
+    for (unsigned int i = 1 ; !task && i < mQueues.size() ; ++i)
+    {
+        Queue& queue = *mQueues[(own + i) % mQueues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+        return false;
+    --mQueued;
+    task();
+    return true;
+}
+
+void TaskScheduler::worker(unsigned int index)
+{
+    currentScheduler = this;
+    currentIndex = index;
+
+    while (true)
+    {
+        if (this->runOne())
+            continue;
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this]() {return mStop || mQueued > 0;});
+        if (mStop)
+            return;
+    }
+}
@@ -0,0 +1,423 @@
+#include "TiledDetection.h"
+
+#include "MappedFile.h"
+#include "Metrics.h"
+#include "PlaneDetection.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Points are stored at their absolute position, as three doubles, and a color.
+const std::size_t RecordSize = 3 * sizeof(double) + 3;
+// Bytes buffered for a tile before they are appended to its file.
+const std::size_t FlushSize = 1 << 20;
+// Tiles are not split deeper than this, in case of many identical points.
+const unsigned int MaxSplitDepth = 20;
+
+// Peak memory of detection per point, measured with the pointer and linear octrees.
+const std::size_t PointerOctreeBytes = 1100;
+const std::size_t LinearOctreeBytes = 80;
+// Normal and curvature of a point, kept during detection. The k-d tree they are estimated
+// with is freed before the octree is built.
+const std::size_t NormalBytes = 16;
+
+inline void encode(char* p, const Vec3d& point, RGB color)
+{
+    double coordinates[3] = {point.x, point.y, point.z};
+    std::memcpy(p, coordinates, sizeof(coordinates));
+    p[24] = color.r;
+    p[25] = color.g;
+    p[26] = color.b;
+}
+
+inline Vec3d decode(const char* p, RGB& color)
+{
+    double coordinates[3];
+    std::memcpy(coordinates, p, sizeof(coordinates));
+    color = RGB(p[24], p[25], p[26]);
+    return Vec3d(coordinates[0], coordinates[1], coordinates[2]);
+}
+
+const double Infinity = std::numeric_limits<double>::max();
+
+}
+
+TiledDetection::TiledDetection(const std::string& directory, std::size_t maxPoints) :
+    mDirectory(directory), mCreated(false), mMaxPoints(std::max<std::size_t>(1, maxPoints)), mSize(0), mBuffered(0)
+{
+}
+
+TiledDetection::~TiledDetection()
+{
+    for (Tile& tile : mTiles)
+        this->removeTile(tile);
+    if (mCreated)
+        ::rmdir(mDirectory.c_str());
+}
+
+std::size_t TiledDetection::pointsForBudget(std::size_t bytes, bool linearOctree, bool normals)
+{
+    return bytes / ((linearOctree ? LinearOctreeBytes : PointerOctreeBytes) + (normals ? NormalBytes : 0));
+}
+
+bool TiledDetection::split(const std::string& filename, double tileSize)
+{
+    if (::mkdir(mDirectory.c_str(), 0755) == 0)
+        mCreated = true;
+    else if (errno != EEXIST)
+    {
+        std::cerr << "Cannot create " << mDirectory << std::endl;
+        return false;
+    }
+
+    Metrics::Timer timer("tiling");
+
+    // The first points are kept to guess the tile size from their extent.
+    std::vector<std::pair<Vec3d, RGB>> first;
+    Vec3d origin(Infinity, Infinity, Infinity);
+    Vec3d extent(-Infinity, -Infinity, -Infinity);
+    bool gridReady = false;
+
+    std::map<std::array<std::int64_t, 3>, std::size_t> cells;
+    std::array<std::int64_t, 3> lastKey = {{0, 0, 0}};
+    std::size_t lastTile = std::size_t(-1);
+    bool ok = true;
+
+    auto bin = [&](const Vec3d& p, RGB color) {
+        std::array<std::int64_t, 3> key;
+        for (int a = 0 ; a < 3 ; ++a)
+            key[a] = std::int64_t(std::floor((p[a] - origin[a]) / tileSize));
+        if (lastTile == std::size_t(-1) || key != lastKey)
+        {
+            auto it = cells.find(key);
+            if (it == cells.end())
+            {
+                Vec3d low(origin.x + key[0] * tileSize, origin.y + key[1] * tileSize, origin.z + key[2] * tileSize);
+                Vec3d high(origin.x + (key[0] + 1) * tileSize, origin.y + (key[1] + 1) * tileSize, origin.z + (key[2] + 1) * tileSize);
+                it = cells.emplace(key, this->addTile(low, high, 0)).first;
+            }
+            lastKey = key;
+            lastTile = it->second;
+        }
+        ok = this->append(lastTile, p, color) && ok;
+    };
+
+    auto setupGrid = [&]() {
+        if (tileSize <= 0)
+        {
+            Vec3d size = extent - origin;
+            tileSize = std::max(size.x, std::max(size.y, size.z));
+            if (!(tileSize > 0))
+                tileSize = 1;
+        }
+        gridReady = true;
+        for (auto&& p : first)
+            bin(p.first, p.second);
+        std::vector<std::pair<Vec3d, RGB>>().swap(first);
+    };
+
+    bool result = Ply().read(filename, [&](const Vec3d& p, RGB color) {
+        if (gridReady)
+        {
+            bin(p, color);
+            return;
+        }
+        if (first.empty())
+            mOrigin = PointCloud::originNear(p);
+        origin.min(p);
+        extent.max(p);
+        first.emplace_back(p, color);
+        if (first.size() >= mMaxPoints)
+            setupGrid();
+    });
+    if (!gridReady)
+        setupGrid();
+    result = result && ok && this->flushAll();
+
+    // Tiles that are too large are split. Their children are appended to mTiles and checked in turn.
+    for (std::size_t i = 0 ; result && i < mTiles.size() ; ++i)
+        if (mTiles[i].count > mMaxPoints && mTiles[i].depth < MaxSplitDepth)
+            result = this->splitTile(i);
+
+    mTiles.erase(std::remove_if(mTiles.begin(), mTiles.end(), [](const Tile& t){return t.count == 0;}), mTiles.end());
+    std::vector<std::vector<char>>().swap(mBuffers);
+
+    mSize = 0;
+    for (const Tile& tile : mTiles)
+        mSize += tile.count;
+    Metrics::setValue("tiles", mTiles.size());
+    return result;
+}
+
+bool TiledDetection::detect(const Detector& detector)
+{
+    mTilePlanes.clear();
+    for (Tile& tile : mTiles)
+    {
+        PointCloud cloud;
+        if (!this->readTile(tile, cloud))
+            return false;
+
+        std::vector<SharedPlane> planes;
+        detector(cloud, planes);
+
+        tile.firstPlane = mTilePlanes.size();
+        for (SharedPlane& plane : planes)
+        {
+            if (!plane)
+                continue;
+            // Point indices are only valid in this tile.
+            plane->clearMembers();
+            mTilePlanes.push_back(plane);
+        }
+        tile.planeCount = mTilePlanes.size() - tile.firstPlane;
+    }
+    return true;
+}
+
+void TiledDetection::merge(double dCos, double countRatio)
+{
+    Metrics::Timer timer("tile_merge");
+
+    // Each class holds the index of the plane that accumulates its statistics.
+    FlatUnionFind<std::uint32_t> groups;
+    groups.reserve(mTilePlanes.size());
+    for (std::uint32_t i = 0 ; i < mTilePlanes.size() ; ++i)
+        groups.append(i, i);
+
+    std::uint64_t attempted = 0;
+    std::uint64_t performed = 0;
+    // Merges change the planes, which may make others mergeable.
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (std::size_t a = 0 ; a < mTiles.size() ; ++a)
+        {
+            for (std::size_t b = a + 1 ; b < mTiles.size() ; ++b)
+            {
+                const Tile& ta = mTiles[a];
+                const Tile& tb = mTiles[b];
+                bool adjacent = true;
+                for (int k = 0 ; k < 3 ; ++k)
+                    adjacent = adjacent && ta.low[k] <= tb.high[k] && tb.low[k] <= ta.high[k];
+                if (!adjacent)
+                    continue;
+
+                for (std::size_t i = ta.firstPlane ; i < ta.firstPlane + ta.planeCount ; ++i)
+                {
+                    for (std::size_t j = tb.firstPlane ; j < tb.firstPlane + tb.planeCount ; ++j)
+                    {
+                        std::uint32_t gi = groups.at(i);
+                        std::uint32_t gj = groups.at(j);
+                        if (gi == gj)
+                            continue;
+                        ++attempted;
+                        // The planes were split by the face between the tiles.
+                        if (mTilePlanes[gi]->mergeableAcross(*mTilePlanes[gj], dCos))
+                        {
+                            mTilePlanes[gi]->merge(*mTilePlanes[gj]);
+                            groups.merge(gj, gi);
+                            ++performed;
+                            merged = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    Metrics::add(Metrics::MergesAttempted, attempted);
+    Metrics::add(Metrics::MergesPerformed, performed);
+
+    double minCount = 0;
+    for (std::uint32_t i = 0 ; i < mTilePlanes.size() ; ++i)
+        if (groups.at(i) == i)
+            minCount = std::max(minCount, mTilePlanes[i]->getCount() * countRatio);
+
+    mPlanes.clear();
+    for (std::uint32_t i = 0 ; i < mTilePlanes.size() ; ++i)
+    {
+        if (groups.at(i) != i || mTilePlanes[i]->getCount() == 0)
+            continue;
+        if (mTilePlanes[i]->getCount() > minCount)
+            mPlanes.push_back(mTilePlanes[i]);
+        else
+            Metrics::add(Metrics::PlanesRemoved);
+    }
+    std::vector<SharedPlane>().swap(mTilePlanes);
+}
+
+bool TiledDetection::write(const std::string& filename, Ply::Format format, unsigned int minPoints, TaskScheduler& scheduler)
+{
+    Ply ply;
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out.is_open() || !ply.writeHeader(out, mSize, format, mOrigin))
+    {
+        std::cerr << "Cannot save " << filename << std::endl;
+        return false;
+    }
+
+    for (const Tile& tile : mTiles)
+    {
+        PointCloud cloud;
+        if (!this->readTile(tile, cloud))
+            return false;
+
+        {
+            Metrics::Timer timer("final_pass");
+            std::vector<SharedPlane> planes;
+            for (SharedPlane& p : mPlanes)
+                if (p->getCount() >= minPoints && p->mayAccept(tile.min - mOrigin, tile.max - mOrigin))
+                    planes.push_back(p);
+            PlaneDetection::projectPoints(cloud, planes, scheduler);
+        }
+
+        Metrics::Timer timer("ply_write");
+        if (!ply.writeVertices(out, cloud, format))
+        {
+            std::cerr << "Cannot save " << filename << std::endl;
+            return false;
+        }
+    }
+
+    out.close();
+    if (out.fail())
+    {
+        std::cerr << "Cannot save " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::size_t TiledDetection::addTile(const Vec3d& low, const Vec3d& high, unsigned int depth)
+{
+    Tile tile;
+    tile.filename = mDirectory + "/tile" + std::to_string(mTiles.size()) + ".bin";
+    tile.count = 0;
+    tile.low = low;
+    tile.high = high;
+    tile.min = Vec3d(Infinity, Infinity, Infinity);
+    tile.max = Vec3d(-Infinity, -Infinity, -Infinity);
+    tile.depth = depth;
+    tile.firstPlane = 0;
+    tile.planeCount = 0;
+    mTiles.push_back(tile);
+    mBuffers.emplace_back();
+    return mTiles.size() - 1;
+}
+
+bool TiledDetection::append(std::size_t tile, const Vec3d& p, RGB color)
+{
+    Tile& t = mTiles[tile];
+    ++t.count;
+    t.min.min(p);
+    t.max.max(p);
+
+    std::vector<char>& buffer = mBuffers[tile];
+    buffer.resize(buffer.size() + RecordSize);
+    encode(buffer.data() + buffer.size() - RecordSize, p, color);
+    mBuffered += RecordSize;
+
+    if (buffer.size() >= FlushSize)
+        return this->flush(tile);
+    // All buffers together stay within the size of one tile.
+    if (mBuffered >= mMaxPoints * RecordSize)
+        return this->flushAll();
+    return true;
+}
+
+bool TiledDetection::flush(std::size_t tile)
+{
+    std::vector<char>& buffer = mBuffers[tile];
+    if (buffer.empty())
+        return true;
+    std::ofstream out(mTiles[tile].filename.c_str(), std::ios::binary | std::ios::app);
+    bool result = out.write(buffer.data(), buffer.size()).good();
+    if (!result)
+        std::cerr << "Cannot write " << mTiles[tile].filename << std::endl;
+    mBuffered -= buffer.size();
+    std::vector<char>().swap(buffer);
+    return result;
+}
+
+bool TiledDetection::flushAll()
+{
+    bool result = true;
+    for (std::size_t i = 0 ; i < mBuffers.size() ; ++i)
+        result = this->flush(i) && result;
+    return result;
+}
+
+bool TiledDetection::splitTile(std::size_t tile)
+{
+    std::size_t children[8];
+    Vec3d low = mTiles[tile].low;
+    Vec3d high = mTiles[tile].high;
+    Vec3d middle = (low + high) / 2;
+    for (int o = 0 ; o < 8 ; ++o)
+    {
+        Vec3d l(o & 4 ? middle.x : low.x, o & 2 ? middle.y : low.y, o & 1 ? middle.z : low.z);
+        Vec3d h(o & 4 ? high.x : middle.x, o & 2 ? high.y : middle.y, o & 1 ? high.z : middle.z);
+        children[o] = this->addTile(l, h, mTiles[tile].depth + 1);
+    }
+
+    MappedFile file;
+    if (!file.open(mTiles[tile].filename))
+    {
+        std::cerr << "Cannot read " << mTiles[tile].filename << std::endl;
+        return false;
+    }
+    const std::size_t count = file.size() / RecordSize;
+    const std::size_t releaseStep = 64 << 20;
+    bool result = true;
+    for (std::size_t i = 0 ; i < count ; ++i)
+    {
+        if (i * RecordSize % releaseStep < RecordSize)
+            file.release(i * RecordSize);
+        RGB color;
+        Vec3d p = decode(file.data() + i * RecordSize, color);
+        int o = (p.x >= middle.x ? 4 : 0) | (p.y >= middle.y ? 2 : 0) | (p.z >= middle.z ? 1 : 0);
+        result = this->append(children[o], p, color) && result;
+    }
+    file.close();
+
+    this->removeTile(mTiles[tile]);
+    return this->flushAll() && result;
+}
+
+bool TiledDetection::readTile(const Tile& tile, PointCloud& cloud) const
+{
+    MappedFile file;
+    if (!file.open(tile.filename) || file.size() != tile.count * RecordSize)
+    {
+        std::cerr << "Cannot read " << tile.filename << std::endl;
+        return false;
+    }
+    cloud.setOrigin(mOrigin);
+    cloud.reserve(tile.count);
+    for (std::size_t i = 0 ; i < tile.count ; ++i)
+    {
+        RGB color;
+        Vec3d p = decode(file.data() + i * RecordSize, color);
+        cloud.addPoint(Point(p - mOrigin), color);
+    }
+    cloud.boundingBox();
+    return true;
+}
+
+void TiledDetection::removeTile(Tile& tile)
+{
+    if (tile.count > 0)
+        std::remove(tile.filename.c_str());
+    tile.count = 0;
+}
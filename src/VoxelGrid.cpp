@@ -0,0 +1,143 @@
+#include "VoxelGrid.h"
+
+#include "Philox.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace {
+
+// Bits of a voxel coordinate in a key.
+const int KeyBits = 21;
+// Voxels are spread over this many partitions by hash, each one built by a single task.
+const std::size_t Partitions = 64;
+// Free slot of a hash table; keys only use 3 * KeyBits bits.
+const std::uint64_t EmptyKey = ~std::uint64_t(0);
+
+// Sum of the points of a voxel.
+struct Voxel
+{
+    PointIndex first;
+    std::uint32_t count;
+    Vec3d sum;
+    std::uint32_t rgb[3];
+};
+
+inline std::size_t partition(std::uint64_t key)
+{
+    return mix64(key) % Partitions;
+}
+
+}
+
+void VoxelGrid::downsample(const PointCloud& cloud, double size, PointCloud& reduced, std::vector<PointIndex>& mapping, TaskScheduler& scheduler)
+{
+    const std::size_t n = cloud.size();
+    mapping.assign(n, InvalidPoint);
+    if (n == 0)
+        return;
+
+    const Vec3d min = cloud.minimum();
+    const Vec3d extent = cloud.maximum() - min;
+    const double maxCells = double((1 << KeyBits) - 1);
+    for (int a = 0 ; a < 3 ; ++a)
+        size = std::max(size, extent[a] / maxCells);
+    if (!(size > 0))
+        size = 1;
+
+    // Key of the voxel of every point.
+    std::vector<std::uint64_t> keys(n);
+    scheduler.parallelFor(0, n, 1 << 14, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin ; i < end ; ++i)
+        {
+            Point p = cloud.point(i);
+            std::uint64_t key = 0;
+            for (int a = 0 ; a < 3 ; ++a)
+            {
+                double cell = std::floor((p[a] - min[a]) / size);
+                key = key << KeyBits | std::uint64_t(std::max(0.0, std::min(maxCells, cell)));
+            }
+            keys[i] = key;
+        }
+    });
+
+    // Points of each partition, in increasing order.
+    std::vector<std::size_t> start(Partitions + 1);
+    for (std::size_t i = 0 ; i < n ; ++i)
+        ++start[partition(keys[i]) + 1];
+    for (std::size_t k = 0 ; k < Partitions ; ++k)
+        start[k + 1] += start[k];
+    std::vector<PointIndex> order(n);
+    {
+        std::vector<std::size_t> next(start.begin(), start.end() - 1);
+        for (std::size_t i = 0 ; i < n ; ++i)
+            order[next[partition(keys[i])]++] = i;
+    }
+
+    // Each partition sums its voxels in point order, so sums do not depend on scheduling.
+    // mapping temporarily holds the index of the voxel in its partition.
+    std::vector<std::vector<Voxel>> voxels(Partitions);
+    scheduler.parallelFor(0, Partitions, 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t k = begin ; k < end ; ++k)
+        {
+            // Open addressing with linear probing, at most half full. The low bits of the
+            // hash select the partition, so the slot is taken from the high bits.
+            std::size_t bits = 1;
+            while ((std::size_t(1) << bits) < 2 * (start[k + 1] - start[k]))
+                ++bits;
+            const std::size_t mask = (std::size_t(1) << bits) - 1;
+            std::vector<std::uint64_t> slotKeys(mask + 1, EmptyKey);
+            std::vector<std::uint32_t> slotVoxels(mask + 1);
+            for (std::size_t o = start[k] ; o < start[k + 1] ; ++o)
+            {
+                PointIndex i = order[o];
+                std::size_t s = (mix64(keys[i]) >> (64 - bits)) & mask;
+                while (slotKeys[s] != EmptyKey && slotKeys[s] != keys[i])
+                    s = (s + 1) & mask;
+                if (slotKeys[s] == EmptyKey)
+                {
+                    slotKeys[s] = keys[i];
+                    slotVoxels[s] = voxels[k].size();
+                    voxels[k].push_back(Voxel{i, 0, Vec3d(), {0, 0, 0}});
+                }
+                Voxel& voxel = voxels[k][slotVoxels[s]];
+                RGB color = cloud.color(i);
+                ++voxel.count;
+                voxel.sum += Vec3d(cloud.point(i));
+                voxel.rgb[0] += color.r;
+                voxel.rgb[1] += color.g;
+                voxel.rgb[2] += color.b;
+                mapping[i] = slotVoxels[s];
+            }
+        }
+    });
+
+    // Number the voxels in the order of their first point.
+    std::vector<std::pair<PointIndex, std::uint32_t>> firsts;
+    for (std::size_t k = 0 ; k < Partitions ; ++k)
+        for (std::uint32_t v = 0 ; v < voxels[k].size() ; ++v)
+            firsts.emplace_back(voxels[k][v].first, std::uint32_t(k));
+    std::sort(firsts.begin(), firsts.end());
+
+    std::vector<std::vector<PointIndex>> numbers(Partitions);
+    for (std::size_t k = 0 ; k < Partitions ; ++k)
+        numbers[k].resize(voxels[k].size());
+    reduced = PointCloud();
+    reduced.setOrigin(cloud.origin());
+    reduced.reserve(firsts.size());
+    for (const auto& f : firsts)
+    {
+        const Voxel& voxel = voxels[f.second][mapping[f.first]];
+        RGB color(
+            (voxel.rgb[0] + voxel.count / 2) / voxel.count,
+            (voxel.rgb[1] + voxel.count / 2) / voxel.count,
+            (voxel.rgb[2] + voxel.count / 2) / voxel.count);
+        numbers[f.second][mapping[f.first]] = reduced.addPoint(Point(voxel.sum / voxel.count), color);
+    }
+    reduced.boundingBox();
+
+    scheduler.parallelFor(0, n, 1 << 14, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin ; i < end ; ++i)
+            mapping[i] = numbers[partition(keys[i])][mapping[i]];
+    });
+}
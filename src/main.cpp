@@ -1,59 +1,483 @@
 #include "PointCloud.h"
+#include "BoundedQueue.h"
+#include "DetectionCache.h"
 #include "Octree.h"
+#include "LinearOctree.h"
+#include "Metrics.h"
+#include "NormalEstimation.h"
+#include "ParameterSweep.h"
 #include "Ply.h"
+#include "PlaneDetection.h"
+#include "PlaneKernels.h"
+#include "TaskScheduler.h"
+#include "TiledDetection.h"
+#include "VoxelGrid.h"
 
 #include <fstream>
-#include <opencv2/core.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
 
-void run(PointCloud& cloud, const std::string& name)
+// Command line options.
+struct Options
+{
+    Ply::Format format = Ply::Ascii;
+    unsigned int threads = 0;
+    // Use LinearOctree instead of Octree.
+    bool linearOctree = false;
+    unsigned int leafCapacity = 16;
+    // Memory budget of out-of-core detection in MB, 0 to load the whole cloud.
+    std::size_t tileBudget = 0;
+    // Side of the tiles, 0 to guess it.
+    double tileSize = 0;
+    // Side of the voxels the cloud is downsampled to before detection, 0 to keep all points.
+    double voxelSize = 0;
+    // Neighbours the normals of the points are estimated from, 0 to detect without normals.
+    unsigned int normalNeighbors = 0;
+    // Detection cache file, empty to always detect.
+    std::string cache;
+    // Parameter sets to compare, empty to detect with params only.
+    std::string sweep;
+    DetectionParams params;
+};
+
+// Estimate the normals of the points if options ask for them.
+void estimateNormals(PointCloud& cloud, const Options& options, TaskScheduler& scheduler)
+{
+    if (options.normalNeighbors > 0)
+    {
+        Metrics::Timer timer("normal_estimation");
+        NormalEstimation::estimate(cloud, options.normalNeighbors, scheduler);
+    }
+}
+
+// Detect planes with the octree chosen in options.
+void detect(PointCloud& cloud, const Options& options, TaskScheduler& scheduler, std::default_random_engine& random, std::vector<SharedPlane>& planes)
+{
+    estimateNormals(cloud, options, scheduler);
+    auto detectWith = [&](auto build) {
+        Metrics::Timer buildTimer("octree_build");
+        auto octree = build();
+        buildTimer.stop();
+        Metrics::Timer timer("detection");
+        octree.detectPlanes(options.params, random, planes, cloud.colors(), scheduler);
+    };
+    if (options.linearOctree)
+        detectWith([&](){return LinearOctree(cloud, options.leafCapacity, scheduler);});
+    else
+        detectWith([&](){return Octree(cloud, 30);});
+}
+
+// Detect planes in the cloud, or in the cloud downsampled to reduced if voxelSize is set, with
+// mapping from the points of the cloud to those of reduced.
+void detectCloud(PointCloud& cloud, const Options& options, TaskScheduler& scheduler, PointCloud& reduced, std::vector<PointIndex>& mapping, std::vector<SharedPlane>& planes)
 {
-    Ply ply;
     std::default_random_engine random;
-    
-    Octree octree(cloud, 30);
-    std::vector<SharedPlane> planes;
-    
-    octree.detectPlanes(100, 0.05, 10, 30, 10, 0.005, random, planes, cloud.colors(), std::cos(3.1415/180 * 15));
+    if (options.voxelSize > 0)
+    {
+        Metrics::Timer timer("voxel_grid");
+        VoxelGrid::downsample(cloud, options.voxelSize, reduced, mapping, scheduler);
+    }
+    detect(mapping.empty() ? cloud : reduced, options, scheduler, random, planes);
+}
+
+// Project the points of the cloud on the planes of at least 100 points. If the planes were
+// detected in reduced, every point goes to the plane of the point that replaced it.
+void finalPass(PointCloud& cloud, const PointCloud& reduced, const std::vector<PointIndex>& mapping, const std::vector<SharedPlane>& planes, TaskScheduler& scheduler)
+{
+    Metrics::Timer finalTimer("final_pass");
+    std::vector<SharedPlane> large;
+    for (auto p: planes)
+        if (p->getCount() >= 100)
+            large.push_back(p);
+    if (!mapping.empty())
+    {
+        std::vector<int> reducedOwner;
+        PlaneDetection::closestPlanes(reduced, large, reducedOwner, scheduler);
+        std::vector<int> owner(cloud.size());
+        for (PointIndex i = 0 ; i < cloud.size() ; ++i)
+            owner[i] = reducedOwner[mapping[i]];
+        PlaneDetection::projectPoints(cloud, large, owner, scheduler);
+    }
+    else
+        PlaneDetection::projectPoints(cloud, large, scheduler);
+}
 
+// Sort planes by size, print them if asked and save them to name.planes, in absolute
+// coordinates: the planes are relative to origin.
+void writePlanes(std::vector<SharedPlane>& planes, const std::string& name, const Vec3d& origin, bool print = true)
+{
+    Metrics::Timer planesTimer("planes_write");
     std::sort(planes.begin(), planes.end(), [](const SharedPlane& a, const SharedPlane& b){return a->getCount() < b->getCount();});
 
+    auto absolute = [&](const SharedPlane& p) {
+        Plane plane(*p);
+        plane.translate(origin);
+        return plane;
+    };
     std::ofstream out((name + ".planes").c_str());
+    // Enough digits to read back the equations exactly, far from zero too.
+    out.precision(std::numeric_limits<double>::max_digits10);
     for (unsigned int i = 0 ; i < planes.size() ; ++i)
     {
-        std::cout << *planes[i] << std::endl;
-        out << *planes[planes.size() - i - 1] << std::endl;
+        if (print)
+            std::cout << absolute(planes[i]) << std::endl;
+        out << absolute(planes[planes.size() - i - 1]) << std::endl;
     }
     out.close();
+}
+
+// Hash of the options the planes depend on.
+std::uint64_t paramsHash(const Options& options)
+{
+    std::uint64_t hash = DetectionCache::hashParams(options.params);
+    for (double value : {double(options.linearOctree), double(options.leafCapacity), options.voxelSize, double(options.normalNeighbors)})
+        hash = DetectionCache::combine(hash, value);
+    return hash;
+}
+
+bool run(const std::string& input, const std::string& name, const Options& options, TaskScheduler& scheduler)
+{
+    Ply ply;
+    PointCloud cloud;
+    // Planes are detected in the downsampled cloud, if any, and every point of the cloud
+    // then goes to the plane of the point that replaced it.
+    PointCloud reduced;
+    std::vector<PointIndex> mapping;
+    std::vector<SharedPlane> planes;
+
+    std::uint64_t inputHash = 0;
+    bool cached = false;
+    if (!options.cache.empty())
+    {
+        Metrics::Timer timer("cache_read");
+        if (!DetectionCache::hashFile(input, inputHash, scheduler))
+            return false;
+        cached = DetectionCache::read(options.cache, inputHash, paramsHash(options), cloud, reduced, mapping, planes);
+        if (cached)
+            std::cout << "Detection loaded from " << options.cache << std::endl;
+    }
+
+    if (!cached)
+    {
+        if (!ply.read(input, cloud, scheduler))
+            return false;
+        detectCloud(cloud, options, scheduler, reduced, mapping, planes);
+        if (!mapping.empty())
+            std::cout << reduced.size() << " of " << cloud.size() << " points after downsampling" << std::endl;
+
+        if (!options.cache.empty())
+        {
+            Metrics::Timer timer("cache_write");
+            DetectionCache::write(options.cache, inputHash, paramsHash(options), cloud, reduced, mapping, planes);
+        }
+    }
+    writePlanes(planes, name, cloud.origin());
 
     //cloud.toPly(name + ".ply", true);
     
-    std::vector<SharedPlane> filtered;
-    PointCloud cl;
-    
-    for (auto p: planes) {
-        if (p->points().size() >= 100) {
-            p->points().clear();
-            for (auto point: cloud.points()) {
-                if(p->accept(point)) {
-                    p->points().push_back(point);
-                    cl.addPoint(point, RGB(255, 255, 255));
-                }
+    finalPass(cloud, reduced, mapping, planes, scheduler);
+
+    {
+        Metrics::Timer timer("ply_write");
+        ply.write(name, cloud, options.format);
+    }
+
+    Metrics::setValue("points", cloud.size());
+    Metrics::setValue("planes", planes.size());
+    Metrics::setValue("threads", scheduler.threadCount());
+    Metrics::writeJson(name + ".metrics.json");
+    return true;
+}
+
+// Detect planes with each set of parameters of the sweep file, building the octree once,
+// and save the summary to name.sweep.tsv.
+bool runSweep(const std::string& input, const std::string& name, const Options& options, TaskScheduler& scheduler)
+{
+    ParameterSweep sweep;
+    if (!sweep.read(options.sweep, options.params))
+        return false;
+
+    PointCloud cloud;
+    Ply ply;
+    if (!ply.read(input, cloud, scheduler))
+        return false;
+    PointCloud reduced;
+    std::vector<PointIndex> mapping;
+    if (options.voxelSize > 0)
+    {
+        Metrics::Timer timer("voxel_grid");
+        VoxelGrid::downsample(cloud, options.voxelSize, reduced, mapping, scheduler);
+    }
+    PointCloud& detected = mapping.empty() ? cloud : reduced;
+    estimateNormals(detected, options, scheduler);
+
+    auto sweepWith = [&](auto build) {
+        Metrics::Timer buildTimer("octree_build");
+        auto octree = build();
+        buildTimer.stop();
+        Metrics::Timer timer("sweep");
+        sweep.run(detected.colors(), detected.size(), 100, [&](const DetectionParams& params, std::vector<SharedPlane>& planes, UnionFindPlanes& colors) {
+            std::default_random_engine random;
+            octree.detectPlanes(params, random, planes, colors, scheduler);
+        }, scheduler);
+    };
+    if (options.linearOctree)
+        sweepWith([&](){return LinearOctree(detected, options.leafCapacity, scheduler);});
+    else
+        sweepWith([&](){return Octree(detected, 30);});
+
+    bool result = sweep.write(name + ".sweep.tsv");
+    Metrics::setValue("points", detected.size());
+    Metrics::setValue("sets", sweep.size());
+    Metrics::setValue("threads", scheduler.threadCount());
+    Metrics::writeJson(name + ".metrics.json");
+    return result;
+}
+
+// Cloud of the batch pipeline, passed from stage to stage.
+struct BatchFile
+{
+    std::string input;
+    std::string output;
+    PointCloud cloud;
+    std::vector<SharedPlane> planes;
+    // Empty while the file has not failed.
+    std::string error;
+    double readSeconds = 0;
+    double detectSeconds = 0;
+};
+
+// Run the files of a manifest, one input and output path per line, through three stages: a
+// thread reads the next files while the calling thread detects and projects with all workers,
+// and another thread writes the previous ones. Bounded queues between stages limit the clouds
+// held in memory. Each file is reported in manifest.report.tsv; return false if any failed.
+bool runBatch(const std::string& manifest, const Options& options, TaskScheduler& scheduler)
+{
+    std::vector<std::pair<std::string, std::string>> files;
+    {
+        std::ifstream in(manifest.c_str());
+        if (!in)
+        {
+            std::cerr << "Cannot open " << manifest << std::endl;
+            return false;
+        }
+        std::string line;
+        for (unsigned int number = 1 ; std::getline(in, line) ; ++number)
+        {
+            std::istringstream words(line);
+            std::string input, output, extra;
+            if (!(words >> input) || input[0] == '#')
+                continue;
+            if (!(words >> output) || (words >> extra && extra[0] != '#'))
+            {
+                std::cerr << manifest << ":" << number << ": expected input and output paths" << std::endl;
+                return false;
+            }
+            files.emplace_back(input, output);
+        }
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    auto since = [](Clock::time_point start) {return std::chrono::duration<double>(Clock::now() - start).count();};
+    const std::size_t capacity = 2;
+    BoundedQueue<std::unique_ptr<BatchFile>> loaded(capacity);
+    BoundedQueue<std::unique_ptr<BatchFile>> detected(capacity);
+
+    std::thread reader([&]() {
+        for (const auto& names : files)
+        {
+            std::unique_ptr<BatchFile> file(new BatchFile());
+            file->input = names.first;
+            file->output = names.second;
+            Clock::time_point start = Clock::now();
+            // Serial read, so that this thread never takes detection tasks from the shared
+            // scheduler, nor detection its parsing tasks.
+            Ply ply;
+            if (!ply.read(file->input, file->cloud))
+                file->error = "cannot read input";
+            file->readSeconds = since(start);
+            loaded.push(std::move(file));
+        }
+        loaded.close();
+    });
+
+    std::ofstream report((manifest + ".report.tsv").c_str());
+    report << "input\toutput\tstatus\tpoints\tplanes\tread_seconds\tdetect_seconds\twrite_seconds" << std::endl;
+    std::size_t failures = 0;
+    std::thread writer([&]() {
+        std::unique_ptr<BatchFile> file;
+        while (detected.pop(file))
+        {
+            Clock::time_point start = Clock::now();
+            if (file->error.empty())
+            {
+                writePlanes(file->planes, file->output, file->cloud.origin(), false);
+                Metrics::Timer timer("ply_write");
+                Ply ply;
+                if (!ply.write(file->output, file->cloud, options.format))
+                    file->error = "cannot write output";
+            }
+            double writeSeconds = since(start);
+            failures += !file->error.empty();
+            std::string status = file->error.empty() ? "ok" : file->error;
+            report << file->input << "\t" << file->output << "\t" << status << "\t" << file->cloud.size() << "\t"
+                   << file->planes.size() << "\t" << file->readSeconds << "\t" << file->detectSeconds << "\t" << writeSeconds << std::endl;
+            std::cout << file->input << " -> " << file->output << ": " << status << ", " << file->cloud.size() << " points, "
+                      << file->planes.size() << " planes" << std::endl;
+            // Free the cloud here rather than on the detecting thread.
+            file.reset();
+        }
+    });
+
+    std::unique_ptr<BatchFile> file;
+    while (loaded.pop(file))
+    {
+        if (file->error.empty())
+        {
+            Clock::time_point start = Clock::now();
+            try
+            {
+                PointCloud reduced;
+                std::vector<PointIndex> mapping;
+                detectCloud(file->cloud, options, scheduler, reduced, mapping, file->planes);
+                finalPass(file->cloud, reduced, mapping, file->planes, scheduler);
             }
-            p -> flatten();
-            for (auto point : p->points()) {
-                cl.addPoint(point, RGB(255, 255, 255));
+            catch (const std::exception& e)
+            {
+                file->error = std::string("detection failed: ") + e.what();
+                file->planes.clear();
             }
+            file->detectSeconds = since(start);
         }
+        detected.push(std::move(file));
     }
+    detected.close();
+    reader.join();
+    writer.join();
+    report.close();
+
+    std::cout << files.size() - failures << " of " << files.size() << " files processed" << std::endl;
+    Metrics::setValue("files", files.size());
+    Metrics::setValue("failures", failures);
+    Metrics::setValue("threads", scheduler.threadCount());
+    Metrics::writeJson(manifest + ".metrics.json");
+    return failures == 0;
+}
+
+// Out-of-core variant of run, that never loads more than one tile of the input.
+bool runTiled(const std::string& input, const std::string& name, const Options& options, TaskScheduler& scheduler)
+{
+    std::size_t maxPoints = TiledDetection::pointsForBudget(options.tileBudget << 20, options.linearOctree, options.normalNeighbors > 0);
+    TiledDetection tiles(name + ".tiles", maxPoints);
+    if (!tiles.split(input, options.tileSize))
+        return false;
+
+    std::default_random_engine random;
+    bool result = tiles.detect([&](PointCloud& cloud, std::vector<SharedPlane>& planes) {
+        if (options.voxelSize > 0)
+        {
+            PointCloud reduced;
+            std::vector<PointIndex> mapping;
+            VoxelGrid::downsample(cloud, options.voxelSize, reduced, mapping, scheduler);
+            detect(reduced, options, scheduler, random, planes);
+        }
+        else
+            detect(cloud, options, scheduler, random, planes);
+    });
+    if (!result)
+        return false;
+    tiles.merge(options.params.dCos, options.params.countRatio);
+
+    writePlanes(tiles.planes(), name, tiles.origin());
+    result = tiles.write(name, options.format, 100, scheduler);
 
-    ply.write(name, cloud);
+    Metrics::setValue("points", tiles.size());
+    Metrics::setValue("planes", tiles.planes().size());
+    Metrics::setValue("threads", scheduler.threadCount());
+    Metrics::writeJson(name + ".metrics.json");
+    return result;
 }
 
 int main(int argc, char** argv)
 {
-    PointCloud cloud;
-    Ply ply;
-    ply.read(argv[1], cloud);
-    run(cloud, argv[2]);
-    return 0;
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " input.ply output.ply [--binary] [--threads N] [--linear-octree] [--leaf-capacity N] [--simd scalar|sse2|avx2] [--steps N] [--confidence C] [--preemptive-subset N] [--preemptive-ratio R] [--global-merge] [--normals K] [--normal-angle A] [--max-curvature C] [--voxel-size S] [--cache FILE] [--sweep FILE] [--tile-budget MB] [--tile-size S]" << std::endl
+                  << "       " << argv[0] << " --batch manifest.txt [options]" << std::endl;
+        return 1;
+    }
+
+    Options options;
+    for (int i = 3 ; i < argc ; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--binary")
+            options.format = Ply::BinaryLittleEndian;
+        else if (arg == "--threads" && i + 1 < argc)
+            options.threads = std::stoi(argv[++i]);
+        else if (arg == "--linear-octree")
+            options.linearOctree = true;
+        else if (arg == "--leaf-capacity" && i + 1 < argc)
+            options.leafCapacity = std::stoi(argv[++i]);
+        else if (arg == "--simd" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            PlaneKernels::Isa isa = name == "avx2" ? PlaneKernels::Avx2 : name == "sse2" ? PlaneKernels::Sse2 : PlaneKernels::Scalar;
+            if (PlaneKernels::setIsa(isa) != isa)
+                std::cerr << "Cannot use " << name << ", using " << PlaneKernels::isaName(PlaneKernels::isa()) << std::endl;
+        }
+        else if (arg == "--steps" && i + 1 < argc)
+            options.params.steps = std::stoi(argv[++i]);
+        else if (arg == "--confidence" && i + 1 < argc)
+            options.params.confidence = std::stod(argv[++i]);
+        else if (arg == "--preemptive-subset" && i + 1 < argc)
+            options.params.preemptiveSubset = std::stoi(argv[++i]);
+        else if (arg == "--preemptive-ratio" && i + 1 < argc)
+            options.params.preemptiveRatio = std::stod(argv[++i]);
+        else if (arg == "--global-merge")
+            options.params.globalMerge = true;
+        else if (arg == "--normals" && i + 1 < argc)
+            options.normalNeighbors = std::stoi(argv[++i]);
+        else if (arg == "--normal-angle" && i + 1 < argc)
+            options.params.normalCos = std::cos(3.1415/180 * std::stod(argv[++i]));
+        else if (arg == "--max-curvature" && i + 1 < argc)
+            options.params.maxCurvature = std::stod(argv[++i]);
+        else if (arg == "--voxel-size" && i + 1 < argc)
+            options.voxelSize = std::stod(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc)
+            options.cache = argv[++i];
+        else if (arg == "--sweep" && i + 1 < argc)
+            options.sweep = argv[++i];
+        else if (arg == "--tile-budget" && i + 1 < argc)
+            options.tileBudget = std::stoull(argv[++i]);
+        else if (arg == "--tile-size" && i + 1 < argc)
+            options.tileSize = std::stod(argv[++i]);
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // The first two arguments are the input and output, or --batch and the manifest.
+    const bool batch = std::string(argv[1]) == "--batch";
+    if (batch && (!options.cache.empty() || !options.sweep.empty() || options.tileBudget > 0))
+    {
+        std::cerr << "--batch cannot be combined with --cache, --sweep or --tile-budget" << std::endl;
+        return 1;
+    }
+
+    TaskScheduler scheduler(options.threads);
+    if (batch)
+        return runBatch(argv[2], options, scheduler) ? 0 : 1;
+    if (!options.sweep.empty())
+        return runSweep(argv[1], argv[2], options, scheduler) ? 0 : 1;
+    if (options.tileBudget > 0)
+        return runTiled(argv[1], argv[2], options, scheduler) ? 0 : 1;
+    return run(argv[1], argv[2], options, scheduler) ? 0 : 1;
 }